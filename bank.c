@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+#include "kasm.h"
+
+/*
+ * Banked output for memories built from several narrow parallel parts.
+ * Word a goes to interleave bank a % interleave at local address
+ * a / interleave, and is cut into bit slices starting from bit 0. Every
+ * (interleave bank, slice) pair is written to its own file, PATH.I.S.
+ */
+
+//slice widths and interleave factor, "8,8,16" and "2" on the command line
+int parse_bank_slices(char *s, bank_layout *layout) {
+    layout->n_slices = 0;
+
+    while (*s) {
+        char *end;
+        uint64_t w = strtoull(s, &end, 10);
+
+        if (end == s || w == 0 || w > 64 || (*end && *end != ','))
+            return 1;
+
+        layout->slices = realloc(layout->slices, sizeof(*layout->slices) * (layout->n_slices + 1));
+        layout->slices[layout->n_slices++] = w;
+
+        s = *end ? end + 1 : end;
+    }
+
+    return layout->n_slices == 0;
+}
+
+int bank_valid(bank_source *src, uint64_t addr) {
+    return !src->valid || ((src->valid[addr >> 6] >> (addr & 63)) & 1);
+}
+
+//a shift and a mask per word, from one or two limbs; with stride 1 the loop vectorises
+void bank_extract(uint64_t *dst, uint64_t *src, uint64_t n, uint64_t stride, uint64_t limbs, uint64_t lo, uint64_t width) {
+    uint64_t k = lo >> 6;
+    uint64_t sh = lo & 63;
+
+    if (k >= limbs) {
+        memset(dst, 0, n * sizeof(*dst));
+        return;
+    }
+
+    uint64_t mask = (width >= 64) ? ~0LU : (1LU << width) - 1;
+
+    if (stride == 1) {
+        for (uint64_t j = 0; j < n; j++)
+            dst[j] = (src[j] >> sh) & mask;
+    } else if (sh == 0 || k + 1 == limbs || sh + width <= 64) {
+        for (uint64_t j = 0; j < n; j++)
+            dst[j] = (src[j * stride + k] >> sh) & mask;
+    } else {
+        for (uint64_t j = 0; j < n; j++)
+            dst[j] = ((src[j * stride + k] >> sh) | (src[j * stride + k + 1] << (64 - sh))) & mask;
+    }
+}
+
+int emit_bank(char *path, bank_source *src, uint64_t *slice, uint64_t n, uint64_t first, uint64_t stride, uint64_t width, emit_format format) {
+    FILE *f = fopen(path, "w");
+
+    if (!f) {
+        perror(path);
+        return 1;
+    }
+
+    uint64_t next = 0;
+
+    for (uint64_t j = 0; j < n; j++) {
+        if (format == EF_BIN) {
+            //gaps are zero, as in a raw image
+            for (uint64_t b = 0; b < width; b += 8)
+                fputc((slice[j] >> b) & 0xFF, f);
+            continue;
+        }
+
+        if (!bank_valid(src, first + j * stride))
+            continue;
+
+        if (j != next) {
+            fprintf(f, "@ ");
+            print_hex(f, j, 0);
+            fprintf(f, "\n");
+        }
+
+        if (format == EF_MEMB)
+            print_bin(f, slice[j], width);
+        else
+            print_hex(f, slice[j], (width + 3) & ~3LU);
+        fprintf(f, "\n");
+
+        next = j + 1;
+    }
+
+    if (fclose(f)) {
+        perror(path);
+        return 1;
+    }
+
+    return 0;
+}
+
+int emit_banks(char *path, bank_source *src, bank_layout *layout, emit_format format) {
+    if (!path) {
+        fprintf(stderr, "Banked output needs an output file name\n");
+        return 1;
+    }
+
+    if (format != EF_MEMH && format != EF_MEMB && format != EF_BIN) {
+        fprintf(stderr, "Warning: banked output supports memh, memb and bin, using memh\n");
+        warn();
+        format = EF_MEMH;
+    }
+
+    //no slices given means one slice of the whole word
+    uint64_t whole = src->bits;
+    uint64_t *slices = layout->n_slices ? layout->slices : &whole;
+    uint64_t n_slices = layout->n_slices ? layout->n_slices : 1;
+    uint64_t interleave = layout->interleave ? layout->interleave : 1;
+
+    uint64_t total = 0;
+    for (uint64_t s = 0; s < n_slices; s++)
+        total += slices[s];
+
+    if (total < src->bits) {
+        fprintf(stderr, "Warning: bank slices cover %lu of %lu bits, the rest is dropped\n", total, src->bits);
+        warn();
+    }
+
+    uint64_t per_bank = (src->size + interleave - 1) / interleave;
+    uint64_t *slice = malloc(sizeof(*slice) * (per_bank + 1));
+    char *name = malloc(strlen(path) + 48);
+    int r = 0;
+
+    for (uint64_t i = 0; i < interleave && !r; i++) {
+        uint64_t n = (src->size > i) ? (src->size - i + interleave - 1) / interleave : 0;
+        uint64_t lo = 0;
+
+        for (uint64_t s = 0; s < n_slices && !r; s++) {
+            bank_extract(slice, src->words + i * src->limbs, n, interleave * src->limbs, src->limbs, lo, slices[s]);
+
+            sprintf(name, "%s.%lu.%lu", path, i, s);
+            r = emit_bank(name, src, slice, n, i, interleave, slices[s], format);
+
+            lo += slices[s];
+        }
+    }
+
+    free(slice);
+    free(name);
+
+    return r;
+}
+
+int emit_banks_image(char *path, char *secname, uint64_t jobs, emit_format format, bank_layout *layout) {
+    image *img = image_create(NULL, secname, 0);
+    image_build(img, secname, jobs);
+
+    bank_source src = { img->size, 32, malloc(sizeof(uint64_t) * (img->size + 1)), 1, img->valid };
+
+    for (uint64_t a = 0; a < img->size; a++)
+        src.words[a] = le32toh(img->words[a]);
+
+    int r = emit_banks(path, &src, layout, format);
+
+    free(src.words);
+    image_free(img);
+
+    return r;
+}
+
+int emit_banks_microcode(char *path, emit_format format, bank_layout *layout) {
+    idef **table;
+    uint64_t n_idefs = get_definitions(&table);
+
+    uint64_t limbs = (get_microcode_bits() + 63) / 64;
+
+    if (limbs == 0)
+        limbs = 1;
+
+    bank_source src = { n_idefs, get_microcode_bits(), malloc(sizeof(uint64_t) * (n_idefs + 1) * limbs), limbs, NULL };
+
+    for (uint64_t i = 0; i < n_idefs; i++)
+        memcpy(&src.words[i * limbs], table[i]->bits.limb, sizeof(uint64_t) * limbs);
+
+    int r = emit_banks(path, &src, layout, format);
+
+    free(src.words);
+
+    return r;
+}
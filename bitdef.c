@@ -8,40 +8,95 @@
 bitdef **bitdef_table = NULL;
 uint64_t n_bitdefs = 0;
 
-uint64_t create_bitdef(uint64_t bit) {
-    if (bit > 63) {
+ucword ucword_zero() {
+    ucword w;
+    w.v = (ucode_vec){ 0 };
+    return w;
+}
+
+ucword ucword_bit(uint64_t bit) {
+    ucword w = ucword_zero();
+    w.limb[bit >> 6] = 1LU << (bit & 63);
+    return w;
+}
+
+ucword ucword_or(ucword a, ucword b) {
+    a.v |= b.v;
+    return a;
+}
+
+int ucword_is_zero(ucword a) {
+    uint64_t r = 0;
+
+    for (int i = 0; i < UCODE_LIMBS; i++)
+        r |= a.limb[i];
+
+    return r == 0;
+}
+
+int ucword_overlaps(ucword a, ucword b) {
+    a.v &= b.v;
+    return !ucword_is_zero(a);
+}
+
+int ucword_test(ucword *a, uint64_t bit) {
+    return (a->limb[bit >> 6] >> (bit & 63)) & 1;
+}
+
+//index of the highest set bit plus one, 0 for an empty word
+uint64_t ucword_width(ucword a) {
+    for (int i = UCODE_LIMBS - 1; i >= 0; i--) {
+        if (a.limb[i])
+            return i * 64 + 64 - __builtin_clzl(a.limb[i]);
+    }
+
+    return 0;
+}
+
+//for the places that take a bit list as a plain number, such as tag values
+uint64_t ucword_low(ucword a) {
+    if (ucword_width(a) > 64) {
+        fprintf(stderr, "Warning: bit list wider than 64 bits used as a number, truncating (line %d)\n", yylineno);
+        warn();
+    }
+
+    return a.limb[0];
+}
+
+ucword create_bitdef(uint64_t bit) {
+    if (bit >= UCODE_MAX_BITS) {
         fprintf(stderr, "Warning: bit specification %lu beyond allowed maximum, treating as 0 (line %d)\n", bit, yylineno);
         warn();
-        return 0;
+        return ucword_zero();
     }
 
-    return (1 << bit);
+    return ucword_bit(bit);
 }
 
-uint64_t merge_bitdef(uint64_t def, uint64_t bit) {
-    if (bit > 63) {
+ucword merge_bitdef(ucword def, uint64_t bit) {
+    if (bit >= UCODE_MAX_BITS) {
         fprintf(stderr, "Warning: bit specification %lu beyond allowed maximum, treating as 0 (line %d)\n", bit, yylineno);
         warn();
         return def;
-    } else if (def & (1 << bit)) {
+    } else if (ucword_test(&def, bit)) {
         fprintf(stderr, "Warning: redundant bit specification %lu, ignoring (line %d)\n", bit, yylineno);
         warn();
         return def;
     }
 
-    return def | (1 << bit);
+    return ucword_or(def, ucword_bit(bit));
 }
 
-uint64_t merge_bitdef2(uint64_t def, uint64_t def2) {
-    if (def & def2) {
+ucword merge_bitdef2(ucword def, ucword def2) {
+    if (ucword_overlaps(def, def2)) {
         fprintf(stderr, "Warning: redundant bit specification, ignoring (line %d)\n", yylineno);
         warn();
     }
 
-    return def | def2;
+    return ucword_or(def, def2);
 }
 
-void register_bitdef(char *ident, uint64_t def) {
+void register_bitdef(char *ident, ucword def) {
     if (bitdef_table) {
         bitdef_table = realloc(bitdef_table, sizeof(*bitdef_table) * (n_bitdefs + 1));
     } else {
@@ -56,7 +111,7 @@ void register_bitdef(char *ident, uint64_t def) {
     bitdef_table[n_bitdefs++] = d;
 }
 
-uint64_t bitdef_lookup(char *ident) {
+ucword bitdef_lookup(char *ident) {
     for (uint64_t i = 0; i < n_bitdefs; i++) {
         if (strcmp(ident, bitdef_table[i]->ident) == 0) {
             return bitdef_table[i]->bits;
@@ -66,11 +121,19 @@ uint64_t bitdef_lookup(char *ident) {
     fprintf(stderr, "Warning: unknown bit definition %s, treating as null (line %d)\n", ident, yylineno);
     warn();
 
-    return 0;
+    return ucword_zero();
+}
+
+uint64_t get_bitdefs(bitdef ***table) {
+    *table = bitdef_table;
+
+    return n_bitdefs;
 }
 
 void print_bitdefs() {
     for (uint64_t i = 0; i < n_bitdefs; i++) {
-        printf("bitdef: %s = %lu\n", bitdef_table[i]->ident, bitdef_table[i]->bits);
+        printf("bitdef: %s = ", bitdef_table[i]->ident);
+        print_ucword_dec(stdout, &bitdef_table[i]->bits);
+        printf("\n");
     }
 }
@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <endian.h>
+
+#include "kasm.h"
+
+/*
+ * CRC32 (IEEE 802.3) and CRC32C (Castagnoli), both reflected with the usual
+ * pre- and post-inversion, over the little-endian bytes of the image. Each
+ * section is checksummed as image_place_section writes it, and the image
+ * checksum is combined from the section checksums and the zero gaps between
+ * them, so the image is never read a second time.
+ */
+
+crc_kind checksum_kind = CRC_NONE;
+int64_t checksum_stamp = -1;
+
+uint32_t crc_polys[] = { 0, 0xEDB88320, 0x82F63B78 };
+char *crc_names[] = { "none", "crc32", "crc32c" };
+
+//slicing-by-8 tables, and x^(2^n) mod p for combining
+uint32_t crc_tables[3][8][256];
+uint32_t crc_x2n[3][32];
+int crc_hw = 0;
+pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+uint32_t crc_multmodp(uint32_t poly, uint32_t a, uint32_t b) {
+    uint32_t m = 1U << 31;
+    uint32_t p = 0;
+
+    while (1) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ poly : b >> 1;
+    }
+
+    return p;
+}
+
+void crc_init_tables() {
+    for (int k = CRC32; k <= CRC32C; k++) {
+        uint32_t (*t)[256] = crc_tables[k];
+
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int b = 0; b < 8; b++)
+                c = (c & 1) ? (c >> 1) ^ crc_polys[k] : c >> 1;
+            t[0][n] = c;
+        }
+
+        for (uint32_t n = 0; n < 256; n++) {
+            for (int s = 1; s < 8; s++)
+                t[s][n] = (t[s-1][n] >> 8) ^ t[0][t[s-1][n] & 0xFF];
+        }
+
+        uint32_t p = 1U << 30;
+        crc_x2n[k][0] = p;
+        for (int n = 1; n < 32; n++)
+            crc_x2n[k][n] = p = crc_multmodp(crc_polys[k], p, p);
+    }
+
+#if defined(__x86_64__)
+    crc_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+void crc_init() {
+    pthread_once(&crc_once, crc_init_tables);
+}
+
+uint32_t crc_slice8(uint32_t (*t)[256], uint32_t crc, const uint8_t *p, uint64_t len) {
+    while (len && ((uintptr_t)p & 7)) {
+        crc = t[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+        len--;
+    }
+
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        v = le64toh(v) ^ crc;
+
+        crc = t[7][v & 0xFF] ^ t[6][(v >> 8) & 0xFF] ^ t[5][(v >> 16) & 0xFF] ^ t[4][(v >> 24) & 0xFF]
+            ^ t[3][(v >> 32) & 0xFF] ^ t[2][(v >> 40) & 0xFF] ^ t[1][(v >> 48) & 0xFF] ^ t[0][v >> 56];
+    }
+
+    while (len--)
+        crc = t[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+
+    return crc;
+}
+
+#if defined(__x86_64__)
+//the SSE4.2 crc32 instruction implements CRC32C only
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, uint64_t len) {
+    uint64_t c = crc;
+
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        c = __builtin_ia32_crc32di(c, v);
+    }
+
+    crc = c;
+    while (len--)
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+
+    return crc;
+}
+#endif
+
+uint32_t crc_update(crc_kind kind, uint32_t crc, const void *buf, uint64_t len) {
+    crc_init();
+    crc = ~crc;
+
+#if defined(__x86_64__)
+    if (kind == CRC32C && crc_hw)
+        return ~crc32c_hw(crc, buf, len);
+#endif
+
+    return ~crc_slice8(crc_tables[kind], crc, buf, len);
+}
+
+//x^(8 * len) mod p
+uint32_t crc_shift(crc_kind kind, uint64_t len) {
+    uint32_t p = 1U << 31;
+
+    for (int k = 3; len; len >>= 1, k++) {
+        if (len & 1)
+            p = crc_multmodp(crc_polys[kind], crc_x2n[kind][k & 31], p);
+    }
+
+    return p;
+}
+
+//checksum of A followed by B, given the checksums of both and the length of B
+uint32_t crc_combine(crc_kind kind, uint32_t crc1, uint32_t crc2, uint64_t len2) {
+    crc_init();
+    return crc_multmodp(crc_polys[kind], crc_shift(kind, len2), crc1) ^ crc2;
+}
+
+//checksum of A followed by len zero bytes, given the checksum of A
+uint32_t crc_zeros(crc_kind kind, uint32_t crc, uint64_t len) {
+    crc_init();
+    return ~crc_multmodp(crc_polys[kind], crc_shift(kind, len), ~crc);
+}
+
+int crc_parse(char *s, crc_kind *kind) {
+    for (int k = CRC32; k <= CRC32C; k++) {
+        if (strcmp(s, crc_names[k]) == 0) {
+            *kind = k;
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+int section_base_cmp(const void *a, const void *b) {
+    section *x = *(section**)a;
+    section *y = *(section**)b;
+
+    return (x->base > y->base) - (x->base < y->base);
+}
+
+/*
+ * Whole image from the section checksums. Words of sections whose ranges
+ * overlap can change after the section was checksummed, so those sections
+ * are checksummed again and the stretch they cover together is read as
+ * one part; every other section is only combined.
+ */
+uint32_t image_crc(image *img, char *secname, crc_kind kind) {
+    section **table;
+    uint64_t n_sections = get_sections(&table);
+
+    section **sorted = malloc(sizeof(*sorted) * (n_sections + 1));
+    uint64_t n = 0;
+
+    for (uint64_t i = 0; i < n_sections; i++) {
+        if (section_selected(table[i], secname) && table[i]->size)
+            sorted[n++] = table[i];
+    }
+
+    qsort(sorted, n, sizeof(*sorted), section_base_cmp);
+
+    uint32_t crc = 0;
+    uint64_t pos = 0;
+
+    for (uint64_t i = 0; i < n;) {
+        uint64_t base = sorted[i]->base;
+        uint64_t end = base + sorted[i]->size;
+        uint64_t j = i + 1;
+
+        for (; j < n && sorted[j]->base < end; j++) {
+            if (sorted[j]->base + sorted[j]->size > end)
+                end = sorted[j]->base + sorted[j]->size;
+        }
+
+        crc = crc_zeros(kind, crc, (base - pos) * sizeof(*img->words));
+
+        if (j == i + 1) {
+            crc = crc_combine(kind, crc, sorted[i]->crc, sorted[i]->size * sizeof(*img->words));
+        } else {
+            for (uint64_t k = i; k < j; k++)
+                image_section_crc(img, sorted[k]);
+
+            uint32_t part = crc_update(kind, 0, &img->words[base], (end - base) * sizeof(*img->words));
+            crc = crc_combine(kind, crc, part, (end - base) * sizeof(*img->words));
+        }
+
+        pos = end;
+        i = j;
+    }
+
+    free(sorted);
+
+    return crc_zeros(kind, crc, (img->size - pos) * sizeof(*img->words));
+}
+
+/*
+ * Reports the checksums and, if a stamp address was given, stores the image
+ * checksum there. The stamp word is zero while the checksums, those of the
+ * sections included, are computed, so a checker has to clear it first.
+ */
+void image_checksum(image *img, char *secname) {
+    crc_kind kind = checksum_kind;
+    int64_t stamp = checksum_stamp;
+
+    if (stamp >= 0 && (uint64_t)stamp >= img->size) {
+        fprintf(stderr, "Warning: checksum stamp address %ld is outside the image\n", stamp);
+        warn();
+        stamp = -1;
+    }
+
+    section **table;
+    uint64_t n_sections = get_sections(&table);
+
+    //only the sections around the stamp need checksumming again
+    if (stamp >= 0 && image_is_set(img, stamp)) {
+        fprintf(stderr, "Warning: checksum stamp overwrites the instruction at address %ld\n", stamp);
+        warn();
+
+        img->words[stamp] = 0;
+
+        for (uint64_t i = 0; i < n_sections; i++) {
+            section *s = table[i];
+
+            if (section_selected(s, secname) && (uint64_t)stamp >= s->base && (uint64_t)stamp < s->base + s->size)
+                image_section_crc(img, s);
+        }
+    }
+
+    uint32_t crc = image_crc(img, secname, kind);
+
+    for (uint64_t i = 0; i < n_sections; i++) {
+        if (section_selected(table[i], secname))
+            fprintf(stderr, "(%s section %s: %08X, %lu words at %lu)\n", crc_names[kind], table[i]->ident, table[i]->crc, table[i]->size, table[i]->base);
+    }
+
+    fprintf(stderr, "(%s image: %08X, %lu words)\n", crc_names[kind], crc, img->size);
+
+    if (stamp >= 0) {
+        img->words[stamp] = htole32(crc);
+        img->valid[stamp >> 6] |= 1LU << (stamp & 63);
+
+        if (img->insts)
+            img->insts[stamp] = NULL;
+    }
+}
@@ -0,0 +1,311 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "kasm.h"
+
+/*
+ * Dead code elimination. Sections are cut into blocks at every label
+ * address, plus a block for any code before the first label. Starting
+ * from the entry blocks, a live block makes live every block its label
+ * immediates refer to, and the next block unless it ends in a jump or a
+ * halt. Label immediates resolve within their section; a global label
+ * missing from it is taken to mean the label of that name in another
+ * section. Such a reference is still encoded as address 0 of its own
+ * section, so the block there stays as well.
+ *
+ * Dead blocks are removed and the code after them closes up, along with
+ * their labels, except that a global label stays while any of its locals
+ * is live. A section without live blocks is emptied. Sections jumping to
+ * numeric addresses are kept or emptied whole, since closing up would
+ * move their targets.
+ */
+
+dead_section *dead_sections = NULL;
+
+uint64_t *dead_work = NULL;
+uint64_t n_dead_work = 0;
+
+void build_dead_section(section *s, dead_section *d) {
+    uint64_t n = 1;
+
+    for (uint64_t j = 0; j < s->n_labels; j++) {
+        for (label *l = s->label_table[j]; l; l = l->child)
+            n++;
+    }
+
+    d->start = malloc(sizeof(*d->start) * (n + 1));
+    d->first = malloc(sizeof(*d->first) * (n + 1));
+    d->n_blocks = 0;
+
+    //labels are in address order, globals each followed by their locals
+    d->start[d->n_blocks++] = 0;
+    for (uint64_t j = 0; j < s->n_labels; j++) {
+        for (label *l = s->label_table[j]; l; l = l->child) {
+            if (l->address != d->start[d->n_blocks - 1])
+                d->start[d->n_blocks++] = l->address;
+        }
+    }
+
+    uint64_t k = 0;
+    for (uint64_t b = 0; b < d->n_blocks; b++) {
+        while (k < s->n_insts && s->inst_table[k]->address < d->start[b])
+            k++;
+        d->first[b] = k;
+    }
+    d->first[d->n_blocks] = s->n_insts;
+
+    d->live = calloc(d->n_blocks + 1, 1);
+    d->whole = section_has_fixed_jumps(s);
+}
+
+//the block holding a section-relative address
+uint64_t dead_block_of(dead_section *d, uint64_t address) {
+    uint64_t lo = 0, hi = d->n_blocks;
+
+    while (hi - lo > 1) {
+        uint64_t mid = (lo + hi) / 2;
+
+        if (d->start[mid] <= address)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+void dead_mark(uint64_t sec, uint64_t block) {
+    dead_section *d = &dead_sections[sec];
+
+    for (uint64_t b = d->whole ? 0 : block; b < (d->whole ? d->n_blocks : block + 1); b++) {
+        if (d->live[b])
+            continue;
+
+        d->live[b] = 1;
+
+        dead_work = realloc(dead_work, sizeof(*dead_work) * (n_dead_work + 2));
+        dead_work[n_dead_work++] = sec;
+        dead_work[n_dead_work++] = b;
+    }
+}
+
+label* dead_find_global(section *s, char *ident) {
+    for (uint64_t j = 0; j < s->n_labels; j++) {
+        if (strcmp(ident, s->label_table[j]->ident) == 0)
+            return s->label_table[j];
+    }
+
+    return NULL;
+}
+
+void dead_follow(section **sections, uint64_t n_sections, uint64_t sec, inst *in) {
+    //a failed lookup resolves to 0, so only then is the name searched for; the word still holds 0
+    if (in->type == GLOBAL_LABEL && in->immediate == 0 && !dead_find_global(sections[sec], in->immediate_ident)) {
+        dead_mark(sec, 0);
+
+        for (uint64_t t = 0; t < n_sections; t++) {
+            label *l = dead_find_global(sections[t], in->immediate_ident);
+
+            if (l) {
+                dead_mark(t, dead_block_of(&dead_sections[t], l->address));
+                return;
+            }
+        }
+        return;
+    }
+
+    dead_mark(sec, dead_block_of(&dead_sections[sec], in->immediate));
+}
+
+//LABEL, PARENT.LOCAL or a section name
+int dead_mark_entry(section **sections, uint64_t n_sections, char *name) {
+    int found = 0;
+
+    for (uint64_t s = 0; s < n_sections; s++) {
+        if (strcmp(name, sections[s]->ident) == 0) {
+            dead_mark(s, 0);
+            found = 1;
+        }
+
+        for (uint64_t j = 0; j < sections[s]->n_labels; j++) {
+            label *g = sections[s]->label_table[j];
+            uint64_t len = strlen(g->ident);
+
+            if (strncmp(name, g->ident, len) != 0)
+                continue;
+
+            if (name[len] == '\0') {
+                dead_mark(s, dead_block_of(&dead_sections[s], g->address));
+                found = 1;
+            } else if (name[len] == '.') {
+                for (label *l = g->child; l; l = l->child) {
+                    if (strcmp(name + len + 1, l->ident) == 0) {
+                        dead_mark(s, dead_block_of(&dead_sections[s], l->address));
+                        found = 1;
+                    }
+                }
+            }
+        }
+    }
+
+    return found;
+}
+
+//drops dead labels; a global with live locals moves to the first of them
+void dead_prune_labels(section *s, dead_section *d) {
+    uint64_t n = 0;
+
+    for (uint64_t j = 0; j < s->n_labels; j++) {
+        label *g = s->label_table[j];
+        label *tail = g;
+
+        for (label *l = g->child; l; l = l->child) {
+            if (d->live[dead_block_of(d, l->address)]) {
+                tail->child = l;
+                tail = l;
+            } else {
+                fprintf(stderr, "  removed %s: %s.%s\n", s->ident, g->ident, l->ident);
+            }
+        }
+        tail->child = NULL;
+
+        if (d->live[dead_block_of(d, g->address)]) {
+            s->label_table[n++] = g;
+        } else if (g->child) {
+            g->address = g->child->address;
+            s->label_table[n++] = g;
+        } else {
+            fprintf(stderr, "  removed %s: %s\n", s->ident, g->ident);
+        }
+    }
+
+    s->n_labels = n;
+}
+
+//returns the number of words removed
+uint64_t dead_strip_section(section *s, dead_section *d) {
+    uint64_t n_live = 0;
+
+    if (!s->n_insts)
+        return 0;
+
+    for (uint64_t b = 0; b < d->n_blocks; b++)
+        n_live += d->live[b];
+
+    if (n_live == d->n_blocks)
+        return 0;
+
+    uint64_t size = s->size;
+
+    if (!n_live) {
+        fprintf(stderr, "  removed section %s (%lu words)\n", s->ident, size);
+
+        s->n_insts = 0;
+        s->n_labels = 0;
+        s->size = 0;
+
+        return size;
+    }
+
+    inst **table = malloc(sizeof(*table) * (s->n_insts + 1));
+    uint64_t *address = malloc(sizeof(*address) * (s->n_insts + 1));
+    uint64_t *slot_address = malloc(sizeof(*slot_address) * (s->n_insts + 1));
+    uint64_t gone = 0, n = 0;
+
+    for (uint64_t b = 0; b < d->n_blocks; b++) {
+        uint64_t end = (b + 1 < d->n_blocks) ? d->start[b + 1] : s->size;
+
+        for (uint64_t k = d->first[b]; k < d->first[b + 1]; k++) {
+            slot_address[k] = s->inst_table[k]->address - gone;
+
+            if (d->live[b]) {
+                address[n] = slot_address[k];
+                table[n++] = s->inst_table[k];
+            }
+        }
+
+        if (!d->live[b])
+            gone += end - d->start[b];
+    }
+    slot_address[s->n_insts] = s->size - gone;
+
+    dead_prune_labels(s, d);
+    relayout_section(s, table, address, n, slot_address);
+
+    free(address);
+    free(slot_address);
+
+    return gone;
+}
+
+int eliminate_dead_code(char **entries, uint64_t n_entries) {
+    section **sections;
+    uint64_t n_sections = get_sections(&sections);
+
+    if (!n_sections)
+        return 0;
+
+    dead_sections = calloc(n_sections, sizeof(*dead_sections));
+    for (uint64_t s = 0; s < n_sections; s++)
+        build_dead_section(sections[s], &dead_sections[s]);
+
+    //without entries, the program starts at the top of the first section
+    if (!n_entries)
+        dead_mark(0, 0);
+
+    for (uint64_t e = 0; e < n_entries; e++) {
+        if (!dead_mark_entry(sections, n_sections, entries[e])) {
+            fprintf(stderr, "--entry: no label or section %s\n", entries[e]);
+            return 1;
+        }
+    }
+
+    while (n_dead_work) {
+        uint64_t b = dead_work[--n_dead_work];
+        uint64_t s = dead_work[--n_dead_work];
+        dead_section *d = &dead_sections[s];
+        inst *last = NULL;
+
+        for (uint64_t k = d->first[b]; k < d->first[b + 1]; k++) {
+            last = sections[s]->inst_table[k];
+
+            if (last->type == GLOBAL_LABEL || last->type == LOCAL_LABEL)
+                dead_follow(sections, n_sections, s, last);
+        }
+
+        if (b + 1 < d->n_blocks && (!last || inst_flow(last->def) == FLOW_NEXT || inst_flow(last->def) == FLOW_BRANCH))
+            dead_mark(s, b + 1);
+    }
+
+    uint64_t words = 0, blocks = 0, emptied = 0;
+
+    for (uint64_t s = 0; s < n_sections; s++) {
+        dead_section *d = &dead_sections[s];
+        uint64_t dead = 0;
+
+        for (uint64_t b = 0; b < d->n_blocks; b++)
+            dead += !d->live[b] && d->first[b] < d->first[b + 1];
+
+        if (sections[s]->n_insts && !memchr(d->live, 1, d->n_blocks))
+            emptied++;
+        else
+            blocks += dead;
+
+        words += dead_strip_section(sections[s], d);
+
+        free(d->start);
+        free(d->first);
+        free(d->live);
+    }
+
+    relayout_sections();
+
+    fprintf(stderr, "(dead code: %lu sections and %lu blocks removed, %lu words)\n", emptied, blocks, words);
+
+    free(dead_sections);
+    free(dead_work);
+
+    return 0;
+}
@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "kasm.h"
+
+/*
+ * Delta images: the new image is compared against a raw binary image from
+ * a previous build and only the changed address ranges are written. A
+ * delta is a sparse image without gap records, so sparse_load applied on
+ * top of the old image yields the new one. Words past the end of the
+ * shorter image count as zero, as in a raw image.
+ */
+
+#define DELTA_BLOCK (1024)
+//unchanged stretches shorter than a record header are cheaper to resend
+#define DELTA_MERGE (4)
+
+//first address at or after from where a and b differ, or to
+uint64_t delta_next_diff(uint32_t *a, uint32_t *b, uint64_t from, uint64_t to) {
+    //memcmp compares a vector at a time, which makes skipping identical blocks cheap
+    while (from + DELTA_BLOCK <= to && memcmp(&a[from], &b[from], DELTA_BLOCK * sizeof(*a)) == 0)
+        from += DELTA_BLOCK;
+
+    while (from < to && a[from] == b[from])
+        from++;
+
+    return from;
+}
+
+//reads a raw image padded with zeros to at least min_size words
+uint32_t* delta_read_old(char *path, uint64_t min_size, uint64_t *size) {
+    FILE *f = fopen(path, "rb");
+    struct stat st;
+
+    if (!f || fstat(fileno(f), &st)) {
+        perror(path);
+        if (f)
+            fclose(f);
+        return NULL;
+    }
+
+    if (st.st_size % sizeof(uint32_t)) {
+        fprintf(stderr, "Warning: %s is not a whole number of words, ignoring the trailing bytes\n", path);
+        warn();
+    }
+
+    uint64_t n = st.st_size / sizeof(uint32_t);
+    *size = (n > min_size) ? n : min_size;
+
+    uint32_t *words = calloc(*size + 1, sizeof(*words));
+
+    if (fread(words, sizeof(*words), n, f) != n) {
+        perror(path);
+        fclose(f);
+        free(words);
+        return NULL;
+    }
+
+    fclose(f);
+
+    return words;
+}
+
+int emit_delta(char *old_path, char *path, char *secname, uint64_t jobs, int verbose) {
+    image *img = image_create(NULL, secname, 0);
+    image_build(img, secname, jobs);
+
+    uint64_t size;
+    uint32_t *old = delta_read_old(old_path, img->size, &size);
+
+    if (!old) {
+        image_free(img);
+        return 1;
+    }
+
+    //the new image is in memory, so it can be padded to the old image's length in place
+    if (size > img->size) {
+        img->words = realloc(img->words, sizeof(*img->words) * (size + 1));
+        memset(&img->words[img->size], 0, sizeof(*img->words) * (size - img->size));
+    }
+
+    uint32_t *cur = img->words;
+
+    FILE *out = path ? fopen(path, "wb") : stdout;
+
+    if (!out) {
+        perror(path);
+        free(old);
+        image_free(img);
+        return 1;
+    }
+
+    sparse_header(out, size);
+
+    uint64_t n_ranges = 0, n_changed = 0;
+    uint64_t addr = delta_next_diff(old, cur, 0, size);
+
+    while (addr < size) {
+        uint64_t end = addr, next;
+
+        while (1) {
+            while (end < size && old[end] != cur[end])
+                end++;
+
+            next = delta_next_diff(old, cur, end, size);
+
+            if (next >= size || next - end >= DELTA_MERGE)
+                break;
+
+            end = next;
+        }
+
+        if (verbose)
+            fprintf(stderr, "(changed %lu-%lu, %lu words)\n", addr, end - 1, end - addr);
+
+        sparse_extent(out, cur, addr, end);
+
+        n_ranges++;
+        n_changed += end - addr;
+        addr = next;
+    }
+
+    sparse_record(out, SPARSE_END, 0, 0);
+
+    fprintf(stderr, "(delta: %lu of %lu words in %lu ranges)\n", n_changed, size, n_ranges);
+
+    int r = 0;
+
+    if (path && fclose(out)) {
+        perror(path);
+        r = 1;
+    }
+
+    free(old);
+    image_free(img);
+
+    return r;
+}
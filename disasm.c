@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+#include "kasm.h"
+
+/*
+ * Disassembly, the inverse of encode_instruction. The decode table has an
+ * entry for every value of the opcode field (bit 21 up), holding the
+ * definition and its operand/immediate shape from the tags, and the text
+ * of every possible 7-bit operand field is prepared once, so decoding a
+ * word is a handful of table lookups and copies. The text matches
+ * print_instruction with real addresses.
+ */
+
+#define DECODE_OPERAND_BITS (7)
+
+//offset fields of encode_offset, as offset1/offset2 with 0 meaning none
+uint64_t decode_offsets[8][2] = {
+    { 0, 0 }, { 1, 0 }, { 2, 0 }, { 1, 1 }, { 1, 2 }, { 2, 1 }, { 2, 2 }, { 0, 0 }
+};
+
+decode_table* build_decode_table() {
+    decode_table *t = calloc(1, sizeof(*t));
+    t->max_line = DECODE_MAX_LINE;
+
+    idef **table;
+    uint64_t n_idefs = get_definitions(&table);
+
+    for (uint64_t i = 0; i < n_idefs; i++) {
+        decode_entry *e = &t->entry[table[i]->value & ((1 << INST_OPCODE_BITS) - 1)];
+        idef_info *info = idef_get_info(table[i]);
+
+        //first definition wins, as with idef_lookup
+        if (e->def)
+            continue;
+
+        e->def = table[i];
+        e->n_operands = info->n_operands;
+        e->type = (info->n_immediates == 0) ? NONE : (info->n_immediates == 1) ? SINGLE : DOUBLE;
+        e->name_len = strlen(table[i]->ident);
+
+        if (e->name_len + DECODE_MAX_LINE > t->max_line)
+            t->max_line = e->name_len + DECODE_MAX_LINE;
+    }
+
+    for (uint64_t o = 0; o < (1 << DECODE_OPERAND_BITS); o++) {
+        char *p = t->operand_text[o];
+        uint64_t off = o >> 4;
+
+        p += sprintf(p, "r%lu", o & 0xF);
+        if (decode_offsets[off][0])
+            p += sprintf(p, "[%lu]", decode_offsets[off][0] - 1);
+        if (decode_offsets[off][1])
+            p += sprintf(p, "[%lu]", decode_offsets[off][1] - 1);
+
+        t->operand_len[o] = p - t->operand_text[o];
+    }
+
+    return t;
+}
+
+/*
+ * Library entry point: fills in an instruction with its operands in ops.
+ * Returns 1 for an opcode without a definition or an unused offset code.
+ */
+int decode_instruction(decode_table *t, uint32_t word, inst *in, operand ops[3]) {
+    decode_entry *e = &t->entry[word >> 21];
+
+    if (!e->def)
+        return 1;
+
+    memset(in, 0, sizeof(*in));
+    in->def = e->def;
+    in->type = e->type;
+
+    operand **slot[3] = { &in->oper1, &in->oper2, &in->oper3 };
+
+    for (uint64_t k = 0; k < e->n_operands && k < 3; k++) {
+        uint64_t field = (word >> (k * DECODE_OPERAND_BITS)) & ((1 << DECODE_OPERAND_BITS) - 1);
+
+        if ((field >> 4) == 7)
+            return 1;
+
+        ops[k].base = field & 0xF;
+        ops[k].offset1 = decode_offsets[field >> 4][0];
+        ops[k].offset2 = decode_offsets[field >> 4][1];
+        *slot[k] = &ops[k];
+    }
+
+    if (e->type == SINGLE)
+        in->immediate = (word >> 14) & 0x7F;
+    else if (e->type == DOUBLE)
+        in->immediate = (word >> 7) & 0x3FFF;
+
+    return 0;
+}
+
+char* decode_number(char *p, uint64_t n) {
+    char digits[20];
+    int k = 0;
+
+    do {
+        digits[k++] = '0' + n % 10;
+        n /= 10;
+    } while (n);
+
+    while (k)
+        *p++ = digits[--k];
+
+    return p;
+}
+
+char* decode_operand(decode_table *t, char *p, uint32_t word, uint64_t k, uint64_t n_operands) {
+    if (k >= n_operands) {
+        memcpy(p, "(null)", 6);
+        return p + 6;
+    }
+
+    uint64_t field = (word >> (k * DECODE_OPERAND_BITS)) & ((1 << DECODE_OPERAND_BITS) - 1);
+
+    memcpy(p, t->operand_text[field], t->operand_len[field]);
+    return p + t->operand_len[field];
+}
+
+//one line of text for word at address, which buf must have max_line room for
+uint64_t disassemble_word(decode_table *t, uint32_t word, uint64_t address, char *buf) {
+    decode_entry *e = &t->entry[word >> 21];
+    char *p = buf;
+
+    if (!e->def) {
+        p += sprintf(p, "  ?? %08X @ %lu\n", word, address);
+        return p - buf;
+    }
+
+    *p++ = ' ';
+    *p++ = ' ';
+    memcpy(p, e->def->ident, e->name_len);
+    p += e->name_len;
+    *p++ = ' ';
+
+    p = decode_operand(t, p, word, 0, e->n_operands);
+
+    if (e->type == NONE) {
+        *p++ = ',';
+        *p++ = ' ';
+        p = decode_operand(t, p, word, 1, e->n_operands);
+        *p++ = ',';
+        *p++ = ' ';
+        p = decode_operand(t, p, word, 2, e->n_operands);
+    } else if (e->type == SINGLE) {
+        *p++ = ',';
+        *p++ = ' ';
+        p = decode_operand(t, p, word, 1, e->n_operands);
+        *p++ = ',';
+        *p++ = ' ';
+        p = decode_number(p, (word >> 14) & 0x7F);
+    } else {
+        *p++ = ',';
+        *p++ = ' ';
+        p = decode_number(p, (word >> 7) & 0x3FFF);
+    }
+
+    memcpy(p, " @ ", 3);
+    p = decode_number(p + 3, address);
+    *p++ = '\n';
+
+    return p - buf;
+}
+
+int hex_digit(int c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+//the occupied words of a sparse image, skipping its gaps
+int disassemble_sparse(char *path, FILE *out) {
+    image *img = image_read(path);
+
+    if (!img)
+        return 1;
+
+    decode_table *t = build_decode_table();
+    char *obuf = malloc(DECODE_BLOCK * t->max_line);
+    char *p = obuf;
+
+    for (uint64_t a = image_next(img, 0); a < img->size; a = image_next(img, a + 1)) {
+        p += disassemble_word(t, le32toh(img->words[a]), a, p);
+
+        if (p - obuf > (DECODE_BLOCK - 1) * t->max_line) {
+            fwrite(obuf, 1, p - obuf, out);
+            p = obuf;
+        }
+    }
+
+    fwrite(obuf, 1, p - obuf, out);
+
+    free(obuf);
+    free(t);
+    image_free(img);
+
+    return 0;
+}
+
+/*
+ * Decodes a captured stream: raw little-endian words for bin, the occupied
+ * words for sparse, otherwise one word per line in hex (memh) or binary
+ * (memb), with "@ address" lines as the emitters write them.
+ */
+int disassemble(char *path, FILE *out, emit_format format) {
+    if (format == EF_SPARSE)
+        return disassemble_sparse(path, out);
+
+    FILE *f = fopen(path, "rb");
+
+    if (!f) {
+        perror(path);
+        return 1;
+    }
+
+    decode_table *t = build_decode_table();
+    char *obuf = malloc(DECODE_BLOCK * t->max_line);
+    uint64_t address = 0;
+
+    if (format == EF_BIN) {
+        uint32_t *words = malloc(sizeof(*words) * DECODE_BLOCK);
+        uint64_t n;
+
+        while ((n = fread(words, sizeof(*words), DECODE_BLOCK, f)) > 0) {
+            char *p = obuf;
+
+            for (uint64_t k = 0; k < n; k++)
+                p += disassemble_word(t, le32toh(words[k]), address++, p);
+
+            fwrite(obuf, 1, p - obuf, out);
+        }
+
+        free(words);
+    } else {
+        char line[256];
+        char *p = obuf;
+        int radix = (format == EF_MEMB) ? 1 : 4;
+
+        while (fgets(line, sizeof(line), f)) {
+            char *s = line;
+
+            while (*s == ' ' || *s == '\t')
+                s++;
+
+            if (*s == '@') {
+                address = 0;
+                for (s++; *s == ' '; s++)
+                    ;
+                for (int d; (d = hex_digit(*s)) >= 0; s++)
+                    address = (address << 4) | d;
+                continue;
+            }
+
+            uint32_t word = 0;
+            int d, any = 0;
+
+            for (; (d = hex_digit(*s)) >= 0 && d < (1 << radix); s++, any = 1)
+                word = (word << radix) | d;
+
+            if (!any)
+                continue;
+
+            p += disassemble_word(t, word, address++, p);
+
+            if (p - obuf > (DECODE_BLOCK - 1) * t->max_line) {
+                fwrite(obuf, 1, p - obuf, out);
+                p = obuf;
+            }
+        }
+
+        fwrite(obuf, 1, p - obuf, out);
+    }
+
+    fclose(f);
+    free(obuf);
+    free(t);
+
+    return 0;
+}
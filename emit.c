@@ -1,16 +1,26 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <endian.h>
 #include "kasm.h"
 
 void emit_instructions(FILE *f, int verbose, emit_format format, char *secname) {
+    //checksums are computed while the image is built
+    if (format == EF_SPARSE || format == EF_ETF || checksum_kind) {
+        image *img = image_create(NULL, secname, verbose || format == EF_TUPLE || format == EF_ETF);
+        image_build(img, secname, 1);
+        emit_image(f, img, verbose, format);
+        image_free(img);
+        return;
+    }
+
     inst *i = get_instructions(secname);
 
     while (i) {
         if (format == EF_MEMB)
-            print_bin(f, encode_instruction(i), 32);
+            print_bin(f, inst_word(i), 32);
         else if (format == EF_MEMH)
-            print_hex(f, encode_instruction(i), 32);
+            print_hex(f, inst_word(i), 32);
         else if (format == EF_TUPLE)
             emit_tuple(f, i);
         if (verbose) {
@@ -29,15 +39,74 @@ void emit_instructions(FILE *f, int verbose, emit_format format, char *secname)
     }
 }
 
+//same output as emit_instructions, from an image built by image_build
+void emit_image(FILE *f, image *img, int verbose, emit_format format) {
+    if (format == EF_BIN) {
+        fwrite(img->words, sizeof(*img->words), img->size, f);
+        return;
+    } else if (format == EF_SPARSE) {
+        emit_sparse(f, img);
+        return;
+    } else if (format == EF_ETF) {
+        emit_etf(f, img);
+        return;
+    }
+
+    uint64_t addr = image_next(img, 0);
+
+    while (addr < img->size) {
+        //only a checksum stamp occupies a word without an instruction
+        inst *in = img->insts ? img->insts[addr] : NULL;
+
+        if (format == EF_MEMB)
+            print_bin(f, le32toh(img->words[addr]), 32);
+        else if (format == EF_MEMH || (format == EF_TUPLE && !in))
+            print_hex(f, le32toh(img->words[addr]), 32);
+        else if (format == EF_TUPLE)
+            emit_tuple(f, in);
+        if (verbose && in) {
+            fprintf(f, " // ");
+            print_instruction(f, in, 1);
+        } else if (verbose) {
+            fprintf(f, " // %s", crc_names[checksum_kind]);
+        }
+        fprintf(f, "\n");
+
+        uint64_t next = image_next(img, addr + 1);
+
+        if (next < img->size && next > addr + 1) {
+            fprintf(f, "@ ");
+            print_hex(f, next, 0);
+            fprintf(f, "\n");
+        }
+
+        addr = next;
+    }
+}
+
+//one control-store word; text formats leave the line open for a comment
+void emit_ucword(FILE *f, ucword *w, uint64_t bits, emit_format format) {
+    if (format == EF_BIN) {
+        //little-endian, in as many bytes as the word needs
+        for (uint64_t b = 0; b < bits; b += 8)
+            fputc((w->limb[b >> 6] >> (b & 63)) & 0xFF, f);
+    } else if (format == EF_MEMB) {
+        print_ucword_bin(f, w, bits);
+    } else if (format == EF_MEMH) {
+        print_ucword_hex(f, w, bits);
+    }
+}
+
 void emit_microcode(FILE *f, int verbose, emit_format format) {
     idef **table;
     uint64_t n_idefs = get_definitions(&table);
 
     for (uint64_t i = 0; i < n_idefs; i++) {
-        if (format == EF_MEMB)
-            print_bin(f, table[i]->bits, get_microcode_bits());
-        else if (format == EF_MEMH)
-            print_hex(f, table[i]->bits, get_microcode_bits());
+        emit_ucword(f, &table[i]->bits, get_microcode_bits(), format);
+
+        if (format == EF_BIN)
+            continue;
+
         if (verbose)
             fprintf(f, " // %lu -- %s\n", i, table[i]->ident);
         else
@@ -45,43 +114,89 @@ void emit_microcode(FILE *f, int verbose, emit_format format) {
     }
 }
 
-void print_bin(FILE *f, uint64_t n, uint64_t bits) {
-    char *s = malloc(65);
-    char *p = &s[64];
-    p[1] = '\0';
+void print_ucword_bin(FILE *f, ucword *w, uint64_t bits) {
+    char s[UCODE_MAX_BITS + 1];
 
-    for (uint64_t i = 0; i < bits; i++) {
-        if (n & 1)
-            *p-- = '1';
-        else
-            *p-- = '0';
+    if (bits > UCODE_MAX_BITS)
+        bits = UCODE_MAX_BITS;
+
+    for (uint64_t i = 0; i < bits; i++)
+        s[bits - 1 - i] = '0' + ucword_test(w, i);
+    s[bits] = '\0';
+
+    fputs(s, f);
+}
 
-        n >>= 1;
+//bits == 0 prints as few digits as the value needs
+void print_ucword_hex(FILE *f, ucword *w, uint64_t bits) {
+    char s[UCODE_MAX_BITS / 4 + 1];
+    uint64_t digits = (bits + 3) / 4;
+
+    if (bits == 0) {
+        digits = (ucword_width(*w) + 3) / 4;
+        if (digits == 0)
+            digits = 1;
     }
 
-    fprintf(f, "%s", p+1);
-    free(s);
+    if (digits > UCODE_MAX_BITS / 4)
+        digits = UCODE_MAX_BITS / 4;
+
+    for (uint64_t i = 0; i < digits; i++)
+        s[digits - 1 - i] = "0123456789ABCDEF"[(w->limb[i >> 4] >> ((i & 15) * 4)) & 0xF];
+    s[digits] = '\0';
+
+    fputs(s, f);
 }
 
-void print_hex(FILE *f, uint64_t n, uint64_t bits) {
-    char *s = malloc(17);
-    char *p = &s[16];
-    p[1] = '\0';
+void print_ucword_dec(FILE *f, ucword *w) {
+    if (ucword_width(*w) <= 64) {
+        fprintf(f, "%lu", w->limb[0]);
+        return;
+    }
 
-    for (uint64_t i = 0; (i < (bits/4)) || (bits == 0); i++) {
-        if ((n & 0xF) > 9)
-            *p-- = 'A' - 10 + (n & 0xF);
-        else
-            *p-- = '0' + (n & 0xF);
+    //long division by 10^19, one limb at a time
+    char s[UCODE_MAX_BITS / 3 + 2];
+    char *p = &s[sizeof(s) - 1];
+    ucword q = *w;
 
-        n >>= 4;
+    *p = '\0';
 
-        if (bits == 0 && n == 0)
-            break;
+    while (!ucword_is_zero(q)) {
+        unsigned __int128 rem = 0;
+
+        for (int i = UCODE_LIMBS - 1; i >= 0; i--) {
+            unsigned __int128 cur = (rem << 64) | q.limb[i];
+            q.limb[i] = cur / 10000000000000000000LU;
+            rem = cur % 10000000000000000000LU;
+        }
+
+        for (int d = 0; d < 19 && (rem || !ucword_is_zero(q)); d++) {
+            *--p = '0' + rem % 10;
+            rem /= 10;
+        }
     }
 
-    fprintf(f, "%s", p+1);
-    free(s);
+    fputs(p, f);
+}
+
+void print_bin(FILE *f, uint64_t n, uint64_t bits) {
+    ucword w = ucword_zero();
+    w.limb[0] = n;
+    print_ucword_bin(f, &w, bits);
+}
+
+void print_hex(FILE *f, uint64_t n, uint64_t bits) {
+    ucword w = ucword_zero();
+    w.limb[0] = n;
+    print_ucword_hex(f, &w, bits);
+}
+
+//whether encode_instruction takes the immediate without capping it
+int immediate_fits(inst *i) {
+    if (i->type == NONE || i->prefixes)
+        return 1;
+
+    return i->immediate < (i->type == SINGLE ? (1 << 7) : (1 << 14));
 }
 
 uint64_t encode_instruction(inst *i) {
@@ -105,7 +220,9 @@ uint64_t encode_instruction(inst *i) {
     if (i->type == NONE) {
         //do nothing
     } else if (i->type == SINGLE) {
-        if (i->immediate >= (1 << 7)) {
+        if (i->immediate >= (1 << 7) && i->prefixes) {
+            n |= (i->immediate & 0x7F) << 14;
+        } else if (i->immediate >= (1 << 7)) {
             fprintf(stderr, "Warning: short immediate %lu exceeds maximum, capping\n", i->immediate);
             warn();
             n |= 0x7F << 14;
@@ -113,7 +230,9 @@ uint64_t encode_instruction(inst *i) {
             n |= i->immediate << 14;
         }
     } else {
-        if (i->immediate >= (1 << 14)) {
+        if (i->immediate >= (1 << 14) && i->prefixes) {
+            n |= (i->immediate & 0x3FFF) << 7;
+        } else if (i->immediate >= (1 << 14)) {
             if (i->immediate_ident)
                 fprintf(stderr, "Warning: long immediate %s (%lu) exceeds maximum, capping\n", i->immediate_ident, i->immediate);
             else
@@ -128,6 +247,14 @@ uint64_t encode_instruction(inst *i) {
     return (i->def->value << 21) | n;
 }
 
+//uses the encoding done ahead of time by the pipelined encoder, if any
+uint64_t inst_word(inst *i) {
+    if (i->encoded)
+        return i->word;
+
+    return encode_instruction(i);
+}
+
 uint64_t encode_offset(operand *o) {
     if (o->offset2 == 0)
         return o->offset1;
@@ -138,7 +265,9 @@ uint64_t encode_offset(operand *o) {
 
 void emit_tuple(FILE *f, inst *i) {
     //{ {name, bits} , {type, {b, o, o}/{imm}}, ... }
-    fprintf(f, "{{%s,%lu}", i->def->ident, i->def->bits);
+    fprintf(f, "{{%s,", i->def->ident);
+    print_ucword_dec(f, &i->def->bits);
+    fprintf(f, "}");
 
     emit_tuple_operand(f, i->oper1);
     emit_tuple_operand(f, i->oper2);
@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+#include "kasm.h"
+
+/*
+ * The tuple output as one Erlang External Term Format term, readable with a
+ * single binary_to_term/1:
+ *
+ *   [{Address, [{{Name, Bits}, Oper1, Oper2, Oper3, {ImmType, Imm}}, ...]}, ...]
+ *
+ * Each element of the outer list is a run of consecutive addresses, which
+ * replaces the "@ address" lines of the text form. Operands are {} or
+ * {Base, Offset1, Offset2} with x for a missing offset, exactly as in the
+ * text. A word without an instruction (a checksum stamp) is a bare integer.
+ */
+
+#define ETF_VERSION (131)
+#define ETF_SMALL_INTEGER (97)
+#define ETF_INTEGER (98)
+#define ETF_SMALL_TUPLE (104)
+#define ETF_NIL (106)
+#define ETF_LIST (108)
+#define ETF_SMALL_BIG (110)
+#define ETF_SMALL_ATOM_UTF8 (119)
+
+//atoms are limited to 255 characters, so no instruction term is longer than this
+#define ETF_MAX_INST (512)
+
+uint8_t* etf_u32(uint8_t *p, uint32_t v) {
+    v = htobe32(v);
+    memcpy(p, &v, sizeof(v));
+    return p + sizeof(v);
+}
+
+uint8_t* etf_integer(uint8_t *p, uint64_t v) {
+    if (v < 256) {
+        *p++ = ETF_SMALL_INTEGER;
+        *p++ = v;
+    } else if (v <= INT32_MAX) {
+        *p++ = ETF_INTEGER;
+        p = etf_u32(p, v);
+    } else {
+        *p++ = ETF_SMALL_BIG;
+        uint8_t *n = p++;
+        *p++ = 0;
+        for (*n = 0; v; v >>= 8, (*n)++)
+            *p++ = v & 0xFF;
+    }
+
+    return p;
+}
+
+uint8_t* etf_ucword(uint8_t *p, ucword *w) {
+    uint64_t width = ucword_width(*w);
+
+    if (width <= 64)
+        return etf_integer(p, w->limb[0]);
+
+    *p++ = ETF_SMALL_BIG;
+    *p++ = (width + 7) / 8;
+    *p++ = 0;
+    for (uint64_t b = 0; b < width; b += 8)
+        *p++ = (w->limb[b >> 6] >> (b & 63)) & 0xFF;
+
+    return p;
+}
+
+uint8_t* etf_atom(uint8_t *p, char *s) {
+    size_t len = strlen(s);
+
+    if (len > 255)
+        len = 255;
+
+    *p++ = ETF_SMALL_ATOM_UTF8;
+    *p++ = len;
+    memcpy(p, s, len);
+
+    return p + len;
+}
+
+uint8_t* etf_tuple(uint8_t *p, uint8_t arity) {
+    *p++ = ETF_SMALL_TUPLE;
+    *p++ = arity;
+    return p;
+}
+
+uint8_t* etf_list(uint8_t *p, uint32_t length) {
+    *p++ = ETF_LIST;
+    return etf_u32(p, length);
+}
+
+uint8_t* etf_offset(uint8_t *p, uint64_t offset) {
+    return offset ? etf_integer(p, offset - 1) : etf_atom(p, "x");
+}
+
+uint8_t* etf_operand(uint8_t *p, operand *o) {
+    if (!o)
+        return etf_tuple(p, 0);
+
+    p = etf_tuple(p, 3);
+    p = etf_integer(p, o->base);
+    p = etf_offset(p, o->offset1);
+    return etf_offset(p, o->offset2);
+}
+
+uint8_t* etf_inst(uint8_t *p, inst *i) {
+    p = etf_tuple(p, 5);
+
+    p = etf_tuple(p, 2);
+    p = etf_atom(p, i->def->ident);
+    p = etf_ucword(p, &i->def->bits);
+
+    p = etf_operand(p, i->oper1);
+    p = etf_operand(p, i->oper2);
+    p = etf_operand(p, i->oper3);
+
+    p = etf_tuple(p, 2);
+    switch (i->type) {
+        case NONE:
+            p = etf_integer(p, 0);
+            return etf_integer(p, 0);
+        case SINGLE:
+            p = etf_integer(p, 1);
+            break;
+        case DOUBLE:
+        case GLOBAL_LABEL:
+        case LOCAL_LABEL:
+            p = etf_integer(p, 2);
+            break;
+    }
+
+    return etf_integer(p, i->immediate);
+}
+
+//the image must have been created with instructions
+void emit_etf(FILE *f, image *img) {
+    uint8_t buf[ETF_MAX_INST];
+    uint8_t *p = buf;
+    uint64_t n_runs = 0;
+
+    for (uint64_t addr = image_next(img, 0); addr < img->size; addr = image_next(img, image_next_clear(img, addr)))
+        n_runs++;
+
+    *p++ = ETF_VERSION;
+    p = etf_list(p, n_runs);
+    fwrite(buf, 1, p - buf, f);
+
+    uint64_t addr = image_next(img, 0);
+
+    while (addr < img->size) {
+        uint64_t end = image_next_clear(img, addr);
+
+        p = etf_tuple(buf, 2);
+        p = etf_integer(p, addr);
+        p = etf_list(p, end - addr);
+        fwrite(buf, 1, p - buf, f);
+
+        for (; addr < end; addr++) {
+            if (img->insts[addr])
+                p = etf_inst(buf, img->insts[addr]);
+            else
+                p = etf_integer(buf, le32toh(img->words[addr]));
+
+            fwrite(buf, 1, p - buf, f);
+        }
+
+        buf[0] = ETF_NIL;
+        fwrite(buf, 1, 1, f);
+
+        addr = image_next(img, end);
+    }
+
+    buf[0] = ETF_NIL;
+    fwrite(buf, 1, 1, f);
+}
@@ -0,0 +1,352 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "kasm.h"
+
+/*
+ * Folding of duplicate subroutines. A block runs from a global label
+ * address to the next one, so it takes its locals with it. Two blocks
+ * are the same when their instructions are, except that a label
+ * immediate into its own block counts by its offset from the block's
+ * start.
+ *
+ * A later copy is removed when its words are contiguous, it ends in a
+ * jump or halt and nothing falls into it. Its global labels then move to
+ * the first copy, so references to them resolve there, and its locals
+ * go. Folding can make more blocks equal, so it repeats until nothing
+ * changes.
+ *
+ * Label immediates are relative to their section, so a copy can only be
+ * folded into one in the same section. Identical blocks in different
+ * sections are only counted.
+ */
+
+fold_block *fold_blocks = NULL;
+uint64_t n_fold_blocks = 0;
+
+uint64_t *fold_slots = NULL;
+uint64_t fold_mask = 0;
+
+uint64_t fold_folded = 0;
+uint64_t fold_words = 0;
+
+//a label immediate into the block, by offset from its start
+int fold_internal(fold_block *b, inst *in) {
+    return (in->type == GLOBAL_LABEL || in->type == LOCAL_LABEL)
+        && in->immediate >= b->start && in->immediate < b->end;
+}
+
+uint64_t fold_hash_operand(uint64_t h, operand *o) {
+    h = (h ^ (o ? o->base + 1 : 0)) * 0x100000001B3ULL;
+    h = (h ^ (o ? o->offset1 : 0)) * 0x100000001B3ULL;
+    h = (h ^ (o ? o->offset2 : 0)) * 0x100000001B3ULL;
+
+    return h;
+}
+
+uint64_t fold_hash(fold_block *b) {
+    uint64_t h = 0xCBF29CE484222325ULL;
+
+    for (uint64_t k = 0; k < b->n; k++) {
+        inst *in = b->sec->inst_table[b->first + k];
+        int internal = fold_internal(b, in);
+
+        h = (h ^ in->def->value) * 0x100000001B3ULL;
+        h = fold_hash_operand(h, in->oper1);
+        h = fold_hash_operand(h, in->oper2);
+        h = fold_hash_operand(h, in->oper3);
+        h = (h ^ (in->type == LOCAL_LABEL ? GLOBAL_LABEL : in->type)) * 0x100000001B3ULL;
+        h = (h ^ (internal ? in->immediate - b->start : in->immediate)) * 0x100000001B3ULL;
+        h = (h ^ internal) * 0x100000001B3ULL;
+    }
+
+    return h;
+}
+
+int fold_same(fold_block *a, fold_block *b) {
+    if (a->n != b->n || a->hash != b->hash)
+        return 0;
+
+    for (uint64_t k = 0; k < a->n; k++) {
+        inst *x = a->sec->inst_table[a->first + k];
+        inst *y = b->sec->inst_table[b->first + k];
+        int internal = fold_internal(a, x);
+
+        if (x->def != y->def || !same_operand(x->oper1, y->oper1) || !same_operand(x->oper2, y->oper2)
+            || !same_operand(x->oper3, y->oper3) || internal != fold_internal(b, y))
+            return 0;
+
+        if ((x->type == NONE) != (y->type == NONE))
+            return 0;
+
+        if (internal ? x->immediate - a->start != y->immediate - b->start : x->immediate != y->immediate)
+            return 0;
+    }
+
+    return 1;
+}
+
+//refers to a label outside itself
+int fold_external(fold_block *b) {
+    for (uint64_t k = 0; k < b->n; k++) {
+        inst *in = b->sec->inst_table[b->first + k];
+
+        if ((in->type == GLOBAL_LABEL || in->type == LOCAL_LABEL) && !fold_internal(b, in))
+            return 1;
+    }
+
+    return 0;
+}
+
+void build_fold_blocks(section *s) {
+    n_fold_blocks = 0;
+    fold_blocks = realloc(fold_blocks, sizeof(*fold_blocks) * (s->n_labels + 2));
+
+    uint64_t k = 0;
+
+    for (uint64_t j = 0; j <= s->n_labels; j++) {
+        uint64_t start = (j < s->n_labels) ? s->label_table[j]->address : s->size;
+
+        if (j < s->n_labels && n_fold_blocks && fold_blocks[n_fold_blocks - 1].start == start)
+            continue;
+
+        //the block before ends here
+        if (n_fold_blocks) {
+            fold_block *p = &fold_blocks[n_fold_blocks - 1];
+
+            p->end = start;
+            while (k < s->n_insts && s->inst_table[k]->address < start)
+                k++;
+            p->n = k - p->first;
+        } else {
+            while (k < s->n_insts && s->inst_table[k]->address < start)
+                k++;
+        }
+
+        if (j == s->n_labels)
+            break;
+
+        fold_block *b = &fold_blocks[n_fold_blocks++];
+
+        b->sec = s;
+        b->start = start;
+        b->label = j;
+        b->first = k;
+        b->canonical = -1;
+        b->folded = -1;
+    }
+
+    for (uint64_t i = 0; i < n_fold_blocks; i++) {
+        fold_block *b = &fold_blocks[i];
+        inst *last = b->n ? s->inst_table[b->first + b->n - 1] : NULL;
+        inst *before = b->first ? s->inst_table[b->first - 1] : NULL;
+        wcet_flow flow;
+
+        b->hash = fold_hash(b);
+
+        //contiguous, ends in a jump or halt, and nothing runs into it
+        b->foldable = last && before
+            && s->inst_table[b->first]->address == b->start && last->address + 1 == b->end
+            && last->address - s->inst_table[b->first]->address + 1 == b->n
+            && ((flow = inst_flow(last->def)) == FLOW_JUMP || flow == FLOW_HALT)
+            && ((flow = inst_flow(before->def)) == FLOW_JUMP || flow == FLOW_HALT);
+    }
+}
+
+//index of an equal block already in the table, or inserts this one
+int64_t fold_find(uint64_t i) {
+    fold_block *b = &fold_blocks[i];
+
+    for (uint64_t h = b->hash & fold_mask;; h = (h + 1) & fold_mask) {
+        if (fold_slots[h] == 0) {
+            fold_slots[h] = i + 1;
+            return -1;
+        }
+
+        if (fold_same(&fold_blocks[fold_slots[h] - 1], b))
+            return fold_slots[h] - 1;
+    }
+}
+
+//returns the number of blocks folded
+uint64_t fold_section(section *s) {
+    build_fold_blocks(s);
+
+    uint64_t size = 1;
+    while (size < 2 * n_fold_blocks + 2)
+        size *= 2;
+
+    fold_slots = realloc(fold_slots, sizeof(*fold_slots) * size);
+    memset(fold_slots, 0, sizeof(*fold_slots) * size);
+    fold_mask = size - 1;
+
+    uint64_t folded = 0;
+
+    for (uint64_t i = 0; i < n_fold_blocks; i++) {
+        if (!fold_blocks[i].n)
+            continue;
+
+        int64_t c = fold_find(i);
+
+        if (c >= 0 && fold_blocks[i].foldable) {
+            fold_blocks[i].canonical = c;
+            folded++;
+        }
+    }
+
+    if (!folded)
+        return 0;
+
+    for (uint64_t i = n_fold_blocks; i > 0; i--) {
+        fold_block *d = &fold_blocks[i - 1];
+
+        if (d->canonical >= 0) {
+            d->next_folded = fold_blocks[d->canonical].folded;
+            fold_blocks[d->canonical].folded = i - 1;
+        }
+    }
+
+    //labels of a folded block join the front of its copy's
+    label **labels = malloc(sizeof(*labels) * (s->n_labels + 1));
+    uint64_t n_labels = 0;
+
+    for (uint64_t i = 0; i < n_fold_blocks; i++) {
+        fold_block *b = &fold_blocks[i];
+        uint64_t last = (i + 1 < n_fold_blocks) ? fold_blocks[i + 1].label : s->n_labels;
+
+        if (b->canonical >= 0)
+            continue;
+
+        for (int64_t j = b->folded; j >= 0; j = fold_blocks[j].next_folded) {
+            fold_block *d = &fold_blocks[j];
+            uint64_t d_last = ((uint64_t)j + 1 < n_fold_blocks) ? fold_blocks[j + 1].label : s->n_labels;
+
+            for (uint64_t l = d->label; l < d_last; l++) {
+                label *g = s->label_table[l];
+
+                fprintf(stderr, "  folded %s: %s into %s\n", s->ident, g->ident, s->label_table[b->label]->ident);
+                g->address = b->start;
+                g->child = NULL;
+                labels[n_labels++] = g;
+            }
+        }
+
+        for (uint64_t l = b->label; l < last; l++)
+            labels[n_labels++] = s->label_table[l];
+    }
+
+    inst **table = malloc(sizeof(*table) * (s->n_insts + 1));
+    uint64_t *address = malloc(sizeof(*address) * (s->n_insts + 1));
+    uint64_t *slot_address = malloc(sizeof(*slot_address) * (s->n_insts + 1));
+    uint64_t gone = 0, n = 0, k = 0;
+
+    for (uint64_t i = 0; i <= n_fold_blocks; i++) {
+        uint64_t end = (i < n_fold_blocks) ? fold_blocks[i].first : s->n_insts;
+
+        //code ahead of the first label, then each block
+        for (; k < end; k++) {
+            slot_address[k] = s->inst_table[k]->address - gone;
+            address[n] = slot_address[k];
+            table[n++] = s->inst_table[k];
+        }
+
+        if (i == n_fold_blocks)
+            break;
+
+        fold_block *b = &fold_blocks[i];
+
+        for (; k < b->first + b->n; k++) {
+            slot_address[k] = s->inst_table[k]->address - gone;
+
+            if (b->canonical < 0) {
+                address[n] = slot_address[k];
+                table[n++] = s->inst_table[k];
+            }
+        }
+
+        if (b->canonical >= 0) {
+            gone += b->n;
+            fold_words += b->n;
+        }
+    }
+    slot_address[s->n_insts] = s->size - gone;
+
+    memcpy(s->label_table, labels, sizeof(*labels) * n_labels);
+    free(labels);
+
+    relayout_section(s, table, address, n, slot_address);
+    resolve_labels(s, 0);
+
+    free(address);
+    free(slot_address);
+
+    return folded;
+}
+
+//blocks equal to one in an earlier section
+uint64_t fold_count_across(section **sections, uint64_t n_sections) {
+    fold_block *all = NULL;
+    uint64_t n_all = 0, across = 0;
+
+    for (uint64_t s = 0; s < n_sections; s++) {
+        build_fold_blocks(sections[s]);
+
+        all = realloc(all, sizeof(*all) * (n_all + n_fold_blocks + 1));
+        for (uint64_t i = 0; i < n_fold_blocks; i++) {
+            //outside references mean different code in another section
+            if (fold_blocks[i].n && !fold_external(&fold_blocks[i]))
+                all[n_all++] = fold_blocks[i];
+        }
+    }
+
+    uint64_t size = 1;
+    while (size < 2 * n_all + 2)
+        size *= 2;
+
+    fold_slots = realloc(fold_slots, sizeof(*fold_slots) * size);
+    memset(fold_slots, 0, sizeof(*fold_slots) * size);
+    fold_mask = size - 1;
+
+    free(fold_blocks);
+    fold_blocks = all;
+    n_fold_blocks = n_all;
+
+    for (uint64_t i = 0; i < n_all; i++) {
+        int64_t c = fold_find(i);
+
+        if (c >= 0 && all[c].sec != all[i].sec)
+            across++;
+    }
+
+    return across;
+}
+
+void fold_program() {
+    section **sections;
+    uint64_t n_sections = get_sections(&sections);
+
+    for (uint64_t s = 0; s < n_sections; s++) {
+        if (section_has_fixed_jumps(sections[s])) {
+            fprintf(stderr, "Warning: section %s jumps to numeric addresses, not folding it\n", sections[s]->ident);
+            warn();
+            continue;
+        }
+
+        uint64_t folded;
+        while ((folded = fold_section(sections[s])))
+            fold_folded += folded;
+    }
+
+    uint64_t across = fold_count_across(sections, n_sections);
+
+    relayout_sections();
+
+    fprintf(stderr, "(fold: %lu blocks folded, %lu words; %lu copies in other sections left alone)\n", fold_folded, fold_words, across);
+
+    free(fold_blocks);
+    free(fold_slots);
+    fold_blocks = NULL;
+    fold_slots = NULL;
+}
@@ -7,6 +7,9 @@
 idef **idef_table;
 uint64_t n_idefs;
 
+idef **idef_hash = NULL;
+uint64_t idef_hash_size = 0;
+
 uint64_t idef_max_bits = 0;
 uint64_t idef_res_bits = 0;
 
@@ -48,23 +51,59 @@ tag* append_tag(tag *a, tag *b) {
     return b;
 }
 
-void register_idef(char *ident, uint64_t bits, tag *tags) {
+uint64_t hash_ident(char *s) {
+    uint64_t h = 14695981039346656037LU;
+
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211LU;
+    }
+
+    return h;
+}
+
+void idef_hash_insert(idef *d) {
+    uint64_t h = hash_ident(d->ident) & (idef_hash_size - 1);
+
+    while (idef_hash[h]) {
+        //first definition wins, as with a linear search
+        if (strcmp(idef_hash[h]->ident, d->ident) == 0)
+            return;
+        h = (h + 1) & (idef_hash_size - 1);
+    }
+
+    idef_hash[h] = d;
+}
+
+void idef_hash_rebuild() {
+    free(idef_hash);
+
+    idef_hash_size = 64;
+    while (idef_hash_size < n_idefs * 4)
+        idef_hash_size <<= 1;
+
+    idef_hash = calloc(idef_hash_size, sizeof(*idef_hash));
+
+    for (uint64_t i = 0; i < n_idefs; i++)
+        idef_hash_insert(idef_table[i]);
+}
+
+void register_idef(char *ident, ucword bits, tag *tags) {
     idef *i = malloc(sizeof(*i));
 
     i->ident = strdup(ident);
     i->bits = bits;
-    if (bits >= (1LU << idef_max_bits)) {
+    if (ucword_width(bits) > idef_max_bits) {
         fprintf(stderr, "Warning: definition implicitly increases maximum bit width above %lu (line %d)\n", idef_max_bits, yylineno);
         warn();
 
-        while (bits >= (1LU << idef_max_bits)) {
-            idef_max_bits++;
-        }
+        idef_max_bits = ucword_width(bits);
     }
 
     i->n_operands = 3;
     i->n_immediates = 3;
     i->tags = tags;
+    i->info = NULL;
 
     uint64_t rb = 0;
     char *s;
@@ -119,12 +158,19 @@ void register_idef(char *ident, uint64_t bits, tag *tags) {
     }
 
     idef_table[n_idefs++] = i;
+
+    if (n_idefs * 2 > idef_hash_size)
+        idef_hash_rebuild();
+    else
+        idef_hash_insert(i);
 }
 
 void print_idefs() {
     for (uint64_t i = 0; i < n_idefs; i++) {
         printf("idef: %s\n", idef_table[i]->ident);
-        printf("  bits = %lu\n", idef_table[i]->bits);
+        printf("  bits = ");
+        print_ucword_dec(stdout, &idef_table[i]->bits);
+        printf("\n");
         printf("  n_operands = %lu\n", idef_table[i]->n_operands);
         printf("  n_immediates = %lu\n", idef_table[i]->n_immediates);
         printf("  tags:\n");
@@ -145,9 +191,15 @@ void print_idefs() {
 }
 
 idef* idef_lookup(char *ident) {
-    for (uint64_t i = 0; i < n_idefs; i++) {
-        if (strcmp(ident, idef_table[i]->ident) == 0)
-            return idef_table[i];
+    if (!idef_hash)
+        return NULL;
+
+    uint64_t h = hash_ident(ident) & (idef_hash_size - 1);
+
+    while (idef_hash[h]) {
+        if (strcmp(ident, idef_hash[h]->ident) == 0)
+            return idef_hash[h];
+        h = (h + 1) & (idef_hash_size - 1);
     }
 
     return NULL;
@@ -171,6 +223,10 @@ int has_tag(idef *i, char *ident, uint64_t *value_numeric, char **value_ident) {
 }
 
 idef_info* idef_get_info(idef *def) {
+    //tags never change after registration, so the result is cached
+    if (def->info)
+        return def->info;
+
     idef_info *info = malloc(sizeof(*info));
 
     //defaults
@@ -202,6 +258,8 @@ idef_info* idef_get_info(idef *def) {
         info->label_allowed = 0;
     }
 
+    def->info = info;
+
     return info;
 }
 
@@ -211,7 +269,33 @@ uint64_t get_definitions(idef ***table) {
     return n_idefs;
 }
 
+//position in the definition table, which is the opcode without its reserved bits
+uint64_t idef_index(idef *i) {
+    return i->value & ((1LU << (INST_OPCODE_BITS - idef_res_bits)) - 1);
+}
+
+//moves definition i to position[i] and renumbers it, keeping its reserved bits
+void reorder_definitions(uint64_t *position) {
+    idef **old = malloc(sizeof(*old) * (n_idefs + 1));
+    uint64_t low = (1LU << (INST_OPCODE_BITS - idef_res_bits)) - 1;
+
+    memcpy(old, idef_table, sizeof(*old) * n_idefs);
+
+    for (uint64_t i = 0; i < n_idefs; i++) {
+        idef_table[position[i]] = old[i];
+        old[i]->value = position[i] | (old[i]->value & ~low);
+    }
+
+    free(old);
+}
+
 void set_microcode_bits(uint64_t n) {
+    if (n > UCODE_MAX_BITS) {
+        fprintf(stderr, "Warning: microcode width %lu beyond allowed maximum %d, using the maximum (line %d)\n", n, UCODE_MAX_BITS, yylineno);
+        warn();
+        n = UCODE_MAX_BITS;
+    }
+
     if (idef_max_bits > n) {
         fprintf(stderr, "Warning: option reduces bits below previous value (line %d)\n", yylineno);
         warn();
@@ -229,6 +313,11 @@ void set_reserved_bits(uint64_t n) {
     idef_res_bits = n;
 }
 
+//for passes that re-encode every definition, which may make the words narrower
+void replace_microcode_bits(uint64_t n) {
+    idef_max_bits = n;
+}
+
 uint64_t get_microcode_bits() {
     return idef_max_bits;
 }
@@ -0,0 +1,341 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "kasm.h"
+
+/*
+ * Raw binary images: word n of the image is the 32-bit little-endian
+ * encoding of the instruction at real address n, gaps are zero. Every
+ * section is written straight to its final location, so sections can be
+ * placed in any order and from several threads; a bitmap of occupied
+ * words catches conflicts. Where section ranges overlap they are placed
+ * one at a time in order, so the earlier one keeps the address and no
+ * section is checksummed while another writes into it.
+ */
+
+int section_selected(section *s, char *secname) {
+    return !secname || strcmp(s->ident, secname) == 0;
+}
+
+image* image_create(char *path, char *secname, int with_insts) {
+    section **table;
+    uint64_t n_sections = get_sections(&table);
+
+    image *img = calloc(1, sizeof(*img));
+    img->fd = -1;
+
+    for (uint64_t i = 0; i < n_sections; i++) {
+        if (section_selected(table[i], secname) && table[i]->base + table[i]->size > img->size)
+            img->size = table[i]->base + table[i]->size;
+    }
+
+    img->valid = calloc((img->size + 63) / 64 + 1, sizeof(*img->valid));
+
+    //only formats that print the instructions themselves need these
+    if (with_insts)
+        img->insts = calloc(img->size + 1, sizeof(*img->insts));
+
+    if (!path) {
+        img->words = calloc(img->size + 1, sizeof(*img->words));
+        return img;
+    }
+
+    img->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+
+    if (img->fd < 0) {
+        perror(path);
+        free(img->valid);
+        free(img);
+        return NULL;
+    }
+
+    if (img->size == 0)
+        return img;
+
+    if (ftruncate(img->fd, img->size * sizeof(*img->words))) {
+        perror(path);
+        close(img->fd);
+        free(img->valid);
+        free(img);
+        return NULL;
+    }
+
+    img->words = mmap(NULL, img->size * sizeof(*img->words), PROT_READ | PROT_WRITE, MAP_SHARED, img->fd, 0);
+
+    if (img->words == MAP_FAILED) {
+        perror(path);
+        close(img->fd);
+        free(img->valid);
+        free(img);
+        return NULL;
+    }
+
+    img->mapped = 1;
+
+    return img;
+}
+
+//safe to call for sections that do not overlap at the same time; the first word to claim an address wins
+void image_place_section(image *img, section *s) {
+    for (uint64_t j = 0; j < s->n_insts; j++) {
+        inst *in = s->inst_table[j];
+        uint64_t addr = s->base + in->address;
+        uint64_t bit = 1LU << (addr & 63);
+
+        in->real_address = addr;
+
+        if (__atomic_fetch_or(&img->valid[addr >> 6], bit, __ATOMIC_RELAXED) & bit) {
+            fprintf(stderr, "Warning: conflicting instructions at address %lu\n", addr);
+            warn();
+            continue;
+        }
+
+        img->words[addr] = htole32((uint32_t)inst_word(in));
+
+        if (img->insts)
+            img->insts[addr] = in;
+    }
+
+    //checksummed while the words are still in cache; image_crc redoes overlapping sections
+    if (checksum_kind)
+        image_section_crc(img, s);
+}
+
+void image_section_crc(image *img, section *s) {
+    if (s->base + s->size <= img->size)
+        s->crc = crc_update(checksum_kind, 0, &img->words[s->base], s->size * sizeof(*img->words));
+}
+
+//whether the ranges of two selected sections overlap
+int image_overlaps(char *secname) {
+    section **table;
+    uint64_t n_sections = get_sections(&table);
+
+    section **sorted = malloc(sizeof(*sorted) * (n_sections + 1));
+    uint64_t n = 0;
+
+    for (uint64_t i = 0; i < n_sections; i++) {
+        if (section_selected(table[i], secname) && table[i]->size)
+            sorted[n++] = table[i];
+    }
+
+    qsort(sorted, n, sizeof(*sorted), section_base_cmp);
+
+    int overlap = 0;
+    uint64_t end = 0;
+
+    for (uint64_t i = 0; i < n && !overlap; i++) {
+        overlap = i && sorted[i]->base < end;
+        if (sorted[i]->base + sorted[i]->size > end)
+            end = sorted[i]->base + sorted[i]->size;
+    }
+
+    free(sorted);
+
+    return overlap;
+}
+
+typedef struct {
+    image *img;
+    char *secname;
+    section **table;
+    uint64_t n_sections;
+    uint64_t next;
+} place_pool;
+
+void* place_worker(void *arg) {
+    place_pool *pool = arg;
+
+    while (1) {
+        uint64_t i = __sync_fetch_and_add(&pool->next, 1);
+
+        if (i >= pool->n_sections)
+            break;
+
+        if (section_selected(pool->table[i], pool->secname))
+            image_place_section(pool->img, pool->table[i]);
+    }
+
+    return NULL;
+}
+
+void image_build(image *img, char *secname, uint64_t jobs) {
+    place_pool pool = { img, secname, NULL, 0, 0 };
+    pool.n_sections = get_sections(&pool.table);
+
+    jobs = get_jobs(jobs);
+    if (jobs > pool.n_sections)
+        jobs = pool.n_sections;
+    if (jobs > 1 && image_overlaps(secname))
+        jobs = 1;
+
+    pthread_t *workers = malloc(sizeof(*workers) * (jobs + 1));
+    uint64_t n_workers = 0;
+
+    for (; n_workers + 1 < jobs; n_workers++) {
+        if (pthread_create(&workers[n_workers], NULL, place_worker, &pool))
+            break;
+    }
+
+    //the calling thread takes part as well, which also covers jobs == 1
+    place_worker(&pool);
+
+    for (uint64_t i = 0; i < n_workers; i++)
+        pthread_join(workers[i], NULL);
+
+    free(workers);
+
+    if (checksum_kind)
+        image_checksum(img, secname);
+}
+
+int image_is_set(image *img, uint64_t addr) {
+    return (img->valid[addr >> 6] >> (addr & 63)) & 1;
+}
+
+//first occupied address at or after addr, or img->size
+uint64_t image_next(image *img, uint64_t addr) {
+    if (addr >= img->size)
+        return img->size;
+
+    uint64_t w = addr >> 6;
+    uint64_t bits = img->valid[w] & (~0LU << (addr & 63));
+
+    while (!bits) {
+        if (++w > img->size >> 6)
+            return img->size;
+        bits = img->valid[w];
+    }
+
+    addr = (w << 6) + __builtin_ctzl(bits);
+
+    return (addr < img->size) ? addr : img->size;
+}
+
+void image_free(image *img) {
+    if (img->mapped)
+        munmap(img->words, img->size * sizeof(*img->words));
+    else
+        free(img->words);
+
+    if (img->fd >= 0)
+        close(img->fd);
+
+    free(img->valid);
+    free(img->insts);
+    free(img);
+}
+
+int emit_binary(char *path, char *secname, uint64_t jobs, int verbose) {
+    image *img = image_create(path, secname, 0);
+
+    if (!img)
+        return 1;
+
+    image_build(img, secname, jobs);
+
+    if (verbose)
+        fprintf(stderr, "(binary image of %lu words)\n", img->size);
+
+    if (!path)
+        fwrite(img->words, sizeof(*img->words), img->size, stdout);
+
+    image_free(img);
+
+    return 0;
+}
+
+typedef struct {
+    emit_target *target;
+    image *img;
+    int verbose;
+} emit_job;
+
+void* emit_worker(void *arg) {
+    emit_job *job = arg;
+    emit_target *t = job->target;
+
+    FILE *f = fopen(t->path, "w");
+
+    if (!f) {
+        perror(t->path);
+        t->failed = 1;
+        return NULL;
+    }
+
+    if (t->microcode)
+        emit_microcode(f, job->verbose, t->format);
+    else
+        emit_image(f, job->img, job->verbose, t->format);
+
+    if (fclose(f)) {
+        perror(t->path);
+        t->failed = 1;
+    }
+
+    return NULL;
+}
+
+/*
+ * The program is encoded into one in-memory image, which every
+ * instruction target is then formatted from, each on its own thread.
+ */
+int emit_targets(emit_target *targets, uint64_t n_targets, char *secname, int verbose, uint64_t jobs) {
+    int with_insts = verbose;
+    int need_image = 0;
+
+    for (uint64_t i = 0; i < n_targets; i++) {
+        if (!targets[i].microcode) {
+            need_image = 1;
+            if (targets[i].format == EF_TUPLE || targets[i].format == EF_ETF)
+                with_insts = 1;
+        }
+    }
+
+    image *img = NULL;
+
+    if (need_image) {
+        img = image_create(NULL, secname, with_insts);
+        image_build(img, secname, jobs);
+    }
+
+    emit_job *work = malloc(sizeof(*work) * n_targets);
+    pthread_t *threads = malloc(sizeof(*threads) * n_targets);
+    int *started = calloc(n_targets, sizeof(*started));
+
+    for (uint64_t i = 0; i < n_targets; i++) {
+        work[i].target = &targets[i];
+        work[i].img = img;
+        work[i].verbose = verbose;
+        targets[i].failed = 0;
+
+        if (n_targets > 1 && pthread_create(&threads[i], NULL, emit_worker, &work[i]) == 0)
+            started[i] = 1;
+        else
+            emit_worker(&work[i]);
+    }
+
+    int r = 0;
+
+    for (uint64_t i = 0; i < n_targets; i++) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        r |= targets[i].failed;
+    }
+
+    free(work);
+    free(threads);
+    free(started);
+
+    if (img)
+        image_free(img);
+
+    return r;
+}
@@ -13,6 +13,7 @@ uint64_t current_address = 0;
 
 inst **inst_table = NULL;
 uint64_t n_insts = 0;
+uint64_t inst_table_size = 0;
 
 label **label_table = NULL;
 uint64_t n_labels = 0;
@@ -51,40 +52,45 @@ operand* create_operand(uint64_t base, uint64_t offset1, uint64_t offset2) {
 void register_inst(char *ident, operand *oper1, operand *oper2, operand *oper3, imm_type itype, uint64_t immediate, char *immediate_ident) {
     inst *i = malloc(sizeof(*i));
 
-    i->def = idef_lookup(ident);
-
-    if (!i->def) {
-        fprintf(stderr, "Warning: no definition found for instruction %s, ignoring (line %d)\n", ident, yylineno);
-        warn();
-        free(i);
-        return;
-    }
-
     i->oper1 = oper1;
     i->oper2 = oper2;
     i->oper3 = oper3;
 
     i->type = itype;
     i->immediate = immediate;
+    i->encoded = 0;
+    i->prefixes = 0;
     if (immediate_ident)
         i->immediate_ident = strdup(immediate_ident);
     else
         i->immediate_ident = NULL;
 
-    i->address = current_address++;
-
-    if (verify_inst(i)) {
+    if (place_inst(ident, i))
         free(i);
-        return;
+}
+
+int place_inst(char *ident, inst *i) {
+    i->def = idef_lookup(ident);
+
+    if (!i->def) {
+        fprintf(stderr, "Warning: no definition found for instruction %s, ignoring (line %d)\n", ident, yylineno);
+        warn();
+        return 1;
     }
 
-    if (inst_table) {
-        inst_table = realloc(inst_table, sizeof(*inst_table) * (n_insts + 1));
-    } else {
-        inst_table = malloc(sizeof(*inst_table));
+    i->address = current_address++;
+
+    if (verify_inst(i))
+        return 1;
+
+    if (n_insts == inst_table_size) {
+        inst_table_size = inst_table_size ? inst_table_size * 2 : 64;
+        inst_table = realloc(inst_table, sizeof(*inst_table) * inst_table_size);
     }
 
     inst_table[n_insts++] = i;
+
+    return 0;
 }
 
 void register_label(char *ident, label_type type) {
@@ -129,6 +135,9 @@ section_ident* create_section_ident(char *ident, section_type type, uint64_t bas
         s->ident = strdup(name);
     }
 
+    s->type = type;
+    s->base_from = -1;
+
     if (type == REL_IDENT) {
         section *base_section = section_lookup_reverse(base_ident);
 
@@ -138,10 +147,18 @@ section_ident* create_section_ident(char *ident, section_type type, uint64_t bas
             s->base = 0;
         } else {
             s->base = base_section->base + base_section->size;
+
+            for (uint64_t i = n_sections; i > 0; i--) {
+                if (section_table[i-1] == base_section) {
+                    s->base_from = i - 1;
+                    break;
+                }
+            }
         }
     } else if (type == REL_AUTO) {
         if (section_table) {
             s->base = section_table[n_sections-1]->base + section_table[n_sections-1]->size;
+            s->base_from = n_sections - 1;
         } else {
             fprintf(stderr, "Warning: section %s specified as auto without prior section to use as base (line %d)\n", ident, yylineno);
             warn();
@@ -154,26 +171,23 @@ section_ident* create_section_ident(char *ident, section_type type, uint64_t bas
     return s;
 }
 
-void register_section(section_ident *sident) {
-    section *s = malloc(sizeof(*s));
+//label immediates take the section-relative address of their label
+void resolve_labels(section *s, int report) {
+    //the lookups work on the current label table
+    label **saved_table = label_table;
+    uint64_t saved_n = n_labels;
 
-    s->ident = sident->ident;
-    s->base = sident->base;
-  
-    s->inst_table = inst_table;
-    s->n_insts = n_insts;
-    s->size = current_address;
-    s->label_table = label_table;
-    s->n_labels = n_labels;
+    label_table = s->label_table;
+    n_labels = s->n_labels;
 
     uint64_t j = 0;
     label* l = NULL;
     uint64_t addr = 0;
-    for (uint64_t i = 0; i < n_insts; i++) {
+    for (uint64_t i = 0; i < s->n_insts; i++) {
         while (j < n_labels && label_table[j]->address <= addr) {
             l = label_table[j++];
         }
-        inst *in = inst_table[i];
+        inst *in = s->inst_table[i];
 
         if (in->type == GLOBAL_LABEL) {
             label *tmp = label_lookup_global(in->immediate_ident);
@@ -181,8 +195,10 @@ void register_section(section_ident *sident) {
             if (tmp) {
                 in->immediate = tmp->address;
             } else {
-                fprintf(stderr, "Warning: no label %s in section %s, treating as 0 (line %d)\n", in->immediate_ident, s->ident, yylineno);
-                warn();
+                if (report) {
+                    fprintf(stderr, "Warning: no label %s in section %s, treating as 0 (line %d)\n", in->immediate_ident, s->ident, yylineno);
+                    warn();
+                }
                 in->immediate = 0;
             }
         } else if (in->type == LOCAL_LABEL) {
@@ -192,13 +208,17 @@ void register_section(section_ident *sident) {
                 if (tmp) {
                     in->immediate = tmp->address;
                 } else {
-                    fprintf(stderr, "Warning: no local label %s in section %s, treating as 0 (line %d)\n", in->immediate_ident, s->ident, yylineno);
-                    warn();
+                    if (report) {
+                        fprintf(stderr, "Warning: no local label %s in section %s, treating as 0 (line %d)\n", in->immediate_ident, s->ident, yylineno);
+                        warn();
+                    }
                     in->immediate = 0;
                 }
             } else {
-                fprintf(stderr, "Warning: local label without parent [you should never see this error] (line %d)\n", yylineno);
-                warn();
+                if (report) {
+                    fprintf(stderr, "Warning: local label without parent [you should never see this error] (line %d)\n", yylineno);
+                    warn();
+                }
                 in->immediate = 0;
             }
         }
@@ -206,8 +226,29 @@ void register_section(section_ident *sident) {
         addr = in->address;
     }
 
+    label_table = saved_table;
+    n_labels = saved_n;
+}
+
+void register_section(section_ident *sident) {
+    section *s = malloc(sizeof(*s));
+
+    s->ident = sident->ident;
+    s->base = sident->base;
+    s->type = sident->type;
+    s->base_from = sident->base_from;
+  
+    s->inst_table = inst_table;
+    s->n_insts = n_insts;
+    s->size = current_address;
+    s->label_table = label_table;
+    s->n_labels = n_labels;
+
+    resolve_labels(s, 1);
+
     inst_table = NULL;
     n_insts = 0;
+    inst_table_size = 0;
     label_table = NULL;
     n_labels = 0;
 
@@ -222,6 +263,68 @@ void register_section(section_ident *sident) {
     section_table[n_sections++] = s;
 }
 
+/*
+ * Installs a rewritten instruction table for a section, table[i] going to
+ * address[i]. slot_address[k] is the new address of the k-th old
+ * instruction's slot, and slot_address[n_insts] the new size; a label
+ * moves with the slot it preceded, keeping any gap between the two. The
+ * old table must still carry the old addresses.
+ */
+void relayout_section(section *s, inst **table, uint64_t *address, uint64_t n, uint64_t *slot_address) {
+    uint64_t k = 0;
+
+    for (uint64_t j = 0; j < s->n_labels; j++) {
+        for (label *l = s->label_table[j]; l; l = l->child) {
+            //labels are in address order, globals each followed by their locals
+            while (k < s->n_insts && s->inst_table[k]->address < l->address)
+                k++;
+
+            uint64_t old = (k < s->n_insts) ? s->inst_table[k]->address : s->size;
+            l->address = slot_address[k] - (old - l->address);
+        }
+    }
+
+    for (uint64_t i = 0; i < n; i++)
+        table[i]->address = address[i];
+
+    s->size = slot_address[s->n_insts];
+    free(s->inst_table);
+    s->inst_table = table;
+    s->n_insts = n;
+}
+
+//after passes have moved code: bases of relative sections, label immediates, encodings
+void relayout_sections() {
+    //placement can make a section follow a later one
+    for (int changed = 1; changed;) {
+        changed = 0;
+
+        for (uint64_t i = 0; i < n_sections; i++) {
+            section *s = section_table[i];
+
+            if (s->base_from >= 0 && s->base != section_table[s->base_from]->base + section_table[s->base_from]->size) {
+                s->base = section_table[s->base_from]->base + section_table[s->base_from]->size;
+                changed = 1;
+            }
+        }
+    }
+
+    for (uint64_t i = 0; i < n_sections; i++) {
+        section *s = section_table[i];
+
+        resolve_labels(s, 0);
+
+        for (uint64_t j = 0; j < s->n_insts; j++)
+            s->inst_table[j]->encoded = 0;
+    }
+}
+
+uint64_t get_sections(section ***table) {
+    *table = section_table;
+
+    return n_sections;
+}
+
 section* section_lookup(char *ident) {
     for (uint64_t i = 0; i < n_sections; i++) {
         if (strcmp(ident, section_table[i]->ident) == 0) {
@@ -434,11 +537,11 @@ inst* get_instructions(char *secname) {
             } else {
                 inst *tmp = tail;
                 while (tmp->next) {
-                    if (tmp->next->address == newaddr) {
+                    if (tmp->next->real_address == newaddr) {
                         fprintf(stderr, "Warning: conflicting instructions at address %lu\n", newaddr);
                         warn();
                         break;
-                    } else if (tmp->next->address < newaddr) {
+                    } else if (tmp->next->real_address < newaddr) {
                         section_table[i]->inst_table[j]->next = tmp->next;
                         tmp->next = section_table[i]->inst_table[j];
                         tmp->next->real_address = newaddr;
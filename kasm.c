@@ -21,7 +21,41 @@ int werror = 0;
 
 extern FILE *yyin;
 
+enum {
+    OPT_EMIT = 256,
+    OPT_DELTA_FROM,
+    OPT_CRC,
+    OPT_CRC_STAMP,
+    OPT_SLICES,
+    OPT_INTERLEAVE,
+    OPT_PACK,
+    OPT_NANOCODE,
+    OPT_REMAP,
+    OPT_USAGE,
+    OPT_DISASSEMBLE,
+    OPT_SIMULATE,
+    OPT_SIM_STEPS,
+    OPT_SYMBOLS,
+    OPT_SYMBOLIZE,
+    OPT_WCET,
+    OPT_LOOP_BOUND,
+    OPT_SCHEDULE,
+    OPT_PEEPHOLE,
+    OPT_RELAX,
+    OPT_DEAD_CODE,
+    OPT_ENTRY,
+    OPT_FOLD,
+    OPT_PLACE
+};
+
+emit_target *targets = NULL;
+uint64_t n_targets = 0;
+
 int verbose = 0;
+int slow_parse = 0;
+uint64_t jobs = 1;
+int pipeline = 0;
+bank_layout banks = { NULL, 0, 1 };
 emit_format format;
 
 int main(int argc, char **argv) {
@@ -29,10 +63,34 @@ int main(int argc, char **argv) {
     char *secname = NULL;
     char *outfname = NULL;
     char *ucoutfname = NULL;
+    char *delta_from = NULL;
+    char *nanofname = NULL;
+    char *disasmfname = NULL;
+    char *symfname = NULL;
+    char *symbolizefname = NULL;
+    char **usage_files = NULL;
+    uint64_t n_usage_files = 0;
     
     int minfo = 0;
     int massemble = 0;
     int mmicrocode = 0;
+    int mpack = 0;
+    int mremap = 0;
+    int msimulate = 0;
+    int mwcet = 0;
+    int mschedule = 0;
+    int mpeephole = 0;
+    int mrelax = 0;
+    char *wcet_path = NULL;
+    char **loop_bounds = NULL;
+    uint64_t n_loop_bounds = 0;
+    int mdead = 0;
+    int mfold = 0;
+    char *profile_path = NULL;
+    char **entries = NULL;
+    uint64_t n_entries = 0;
+    uint64_t sim_steps = 1000000000;
+    char *sim_path = NULL;
 
     int c;
     while (1) {
@@ -40,17 +98,44 @@ int main(int argc, char **argv) {
         {
             {"verbose", no_argument, &verbose, 1},
             {"werror", no_argument, &werror, 1},
+            {"no-fast-parse", no_argument, &slow_parse, 1},
+            {"pipeline", no_argument, &pipeline, 1},
             {"info", no_argument, 0, 'i'},
             {"out", required_argument, 0, 'o'},
             {"assemble", optional_argument, 0, 'a'},
             {"microcode", optional_argument, 0, 'm'},
             {"dummy", no_argument, 0, 'd'},
             {"format", required_argument, 0, 'f'},
+            {"jobs", required_argument, 0, 'j'},
+            {"emit", required_argument, 0, OPT_EMIT},
+            {"delta-from", required_argument, 0, OPT_DELTA_FROM},
+            {"crc", required_argument, 0, OPT_CRC},
+            {"crc-stamp", required_argument, 0, OPT_CRC_STAMP},
+            {"slices", required_argument, 0, OPT_SLICES},
+            {"interleave", required_argument, 0, OPT_INTERLEAVE},
+            {"pack-microcode", optional_argument, 0, OPT_PACK},
+            {"nanocode", required_argument, 0, OPT_NANOCODE},
+            {"remap-opcodes", no_argument, 0, OPT_REMAP},
+            {"usage", required_argument, 0, OPT_USAGE},
+            {"disassemble", required_argument, 0, OPT_DISASSEMBLE},
+            {"simulate", optional_argument, 0, OPT_SIMULATE},
+            {"sim-steps", required_argument, 0, OPT_SIM_STEPS},
+            {"symbols", required_argument, 0, OPT_SYMBOLS},
+            {"symbolize", required_argument, 0, OPT_SYMBOLIZE},
+            {"wcet", optional_argument, 0, OPT_WCET},
+            {"loop-bound", required_argument, 0, OPT_LOOP_BOUND},
+            {"schedule", no_argument, 0, OPT_SCHEDULE},
+            {"peephole", no_argument, 0, OPT_PEEPHOLE},
+            {"relax", no_argument, 0, OPT_RELAX},
+            {"dead-code", no_argument, 0, OPT_DEAD_CODE},
+            {"entry", required_argument, 0, OPT_ENTRY},
+            {"fold", no_argument, 0, OPT_FOLD},
+            {"place", required_argument, 0, OPT_PLACE},
             {0, 0, 0, 0}
         };
 
         int option_index = 0;
-        c = getopt_long(argc, argv, "io:a::m::dv", long_options, &option_index);
+        c = getopt_long(argc, argv, "io:a::m::dvj:", long_options, &option_index);
 
         if (c == -1)
             break;
@@ -86,16 +171,100 @@ int main(int argc, char **argv) {
             case 'v':
                 verbose = 1;
                 break;
+            case 'j':
+                jobs = strtoull(optarg, NULL, 10);
+                break;
+            case OPT_EMIT:
+                if (add_emit_target(optarg))
+                    fprintf(stderr, "Warning: --emit: expected [uc-]FORMAT=PATH, ignoring %s\n", optarg);
+                break;
+            case OPT_DELTA_FROM:
+                delta_from = optarg;
+                break;
+            case OPT_CRC:
+                if (crc_parse(optarg, &checksum_kind))
+                    fprintf(stderr, "Warning: --crc: expected crc32 or crc32c\n");
+                break;
+            case OPT_CRC_STAMP:
+                checksum_stamp = strtoll(optarg, NULL, 0);
+                if (!checksum_kind)
+                    checksum_kind = CRC32;
+                break;
+            case OPT_SLICES:
+                if (parse_bank_slices(optarg, &banks))
+                    fprintf(stderr, "Warning: --slices: expected bit widths such as 8,8,16\n");
+                break;
+            case OPT_INTERLEAVE:
+                banks.interleave = strtoull(optarg, NULL, 10);
+                if (!banks.interleave)
+                    banks.interleave = 1;
+                break;
+            case OPT_PACK:
+                mpack = 1;
+                if (optarg && strcmp(optarg, "apply") == 0)
+                    mpack = 2;
+                else if (optarg)
+                    fprintf(stderr, "Warning: --pack-microcode: expected no argument or apply\n");
+                break;
+            case OPT_NANOCODE:
+                nanofname = optarg;
+                break;
+            case OPT_REMAP:
+                mremap = 1;
+                break;
+            case OPT_USAGE:
+                usage_files = realloc(usage_files, sizeof(*usage_files) * (n_usage_files + 1));
+                usage_files[n_usage_files++] = optarg;
+                break;
+            case OPT_DISASSEMBLE:
+                disasmfname = optarg;
+                break;
+            case OPT_SIMULATE:
+                msimulate = 1;
+                sim_path = optarg;
+                break;
+            case OPT_SIM_STEPS:
+                sim_steps = strtoull(optarg, NULL, 0);
+                break;
+            case OPT_SYMBOLS:
+                symfname = optarg;
+                break;
+            case OPT_SYMBOLIZE:
+                symbolizefname = optarg;
+                break;
+            case OPT_WCET:
+                mwcet = 1;
+                wcet_path = optarg;
+                break;
+            case OPT_LOOP_BOUND:
+                loop_bounds = realloc(loop_bounds, sizeof(*loop_bounds) * (n_loop_bounds + 1));
+                loop_bounds[n_loop_bounds++] = optarg;
+                break;
+            case OPT_SCHEDULE:
+                mschedule = 1;
+                break;
+            case OPT_PEEPHOLE:
+                mpeephole = 1;
+                break;
+            case OPT_RELAX:
+                mrelax = 1;
+                break;
+            case OPT_DEAD_CODE:
+                mdead = 1;
+                break;
+            case OPT_FOLD:
+                mfold = 1;
+                break;
+            case OPT_PLACE:
+                profile_path = optarg;
+                break;
+            case OPT_ENTRY:
+                entries = realloc(entries, sizeof(*entries) * (n_entries + 1));
+                entries[n_entries++] = optarg;
+                break;
             case 'f':
-                if (strcmp(optarg, "memh") == 0) {
-                    format = EF_MEMH;
-                } else if (strcmp(optarg, "memb") == 0) {
-                    format = EF_MEMB;
-                } else if (strcmp(optarg, "tuple") == 0) {
-                    format = EF_TUPLE;
-                } else {
+                if (parse_format(optarg, &format))
                     fprintf(stderr, "Warning: --format: unknown format\n");
-                }
             case '?':
                 break;
             default:
@@ -104,6 +273,10 @@ int main(int argc, char **argv) {
         }
     }
 
+    //addresses come from stdin, so there is no source to parse
+    if (symbolizefname)
+        return symbolize(symbolizefname);
+
     FILE *f = NULL;
 
     if (optind < argc) {
@@ -116,7 +289,18 @@ int main(int argc, char **argv) {
         yyin = f;
     }
 
-    if (yyparse()) {
+    int banked = banks.n_slices || banks.interleave > 1;
+
+    int r;
+    //passes that move or rewrite code would throw the early encoding away
+    int rewrites = mdead || mpeephole || mfold || mschedule || mrelax || profile_path || mremap;
+
+    if (pipeline && !slow_parse)
+        r = parse_input_pipelined(f, !rewrites, (massemble && !minfo) ? secname : NULL);
+    else
+        r = parse_input(f, !slow_parse, jobs, (massemble && !minfo) ? secname : NULL);
+
+    if (r) {
         if (f)
             fclose(f);
         return 1;
@@ -136,12 +320,63 @@ int main(int argc, char **argv) {
         i = i->next;
     }
 */
+    if (mdead && eliminate_dead_code(entries, n_entries))
+        return 1;
+    if (mpeephole)
+        peephole_program();
+    if (mfold)
+        fold_program();
+    if (mschedule)
+        schedule_program();
+    if (mrelax)
+        relax_program();
+    if (profile_path && place_sections(profile_path))
+        return 1;
+    if (mremap) {
+        opcode_usage *u = usage_create();
+
+        usage_add_program(u);
+        for (uint64_t i = 0; i < n_usage_files; i++) {
+            if (usage_add_image(u, usage_files[i]))
+                return 1;
+        }
+
+        remap_opcodes(u);
+        usage_free(u);
+    }
+    if (mpack) {
+        ucode_packing *p = pack_microcode();
+
+        print_packing(p);
+        if (mpack == 2)
+            pack_apply(p);
+
+        free(p);
+    }
     if (minfo) {
         print_bitdefs();
         print_idefs();
         print_sections();
         print_sections_contents();
     }
+    if (disasmfname) {
+        FILE *out = stdout;
+
+        if (outfname) {
+            out = fopen(outfname, "w");
+
+            if (!out) {
+                perror(outfname);
+                return 1;
+            }
+        }
+
+        if (disassemble(disasmfname, out, format))
+            return 1;
+
+        if (out != stdout)
+            fclose(out);
+    }
     if (massemble) {
         if (verbose) {
             if (secname)
@@ -150,39 +385,135 @@ int main(int argc, char **argv) {
                 printf("(assemble all)\n");
         }
 
-        FILE *out;
-        if (outfname) {
-            out = fopen(outfname, "w");
-
-            if (!f) {
-                perror(ucoutfname);
+        if (banked) {
+            if (emit_banks_image(outfname, secname, jobs, format, &banks))
+                return 1;
+        } else if (delta_from) {
+            if (emit_delta(delta_from, outfname, secname, jobs, verbose))
+                return 1;
+        } else if (format == EF_BIN) {
+            if (emit_binary(outfname, secname, jobs, verbose))
                 return 1;
-            }
         } else {
-            out = stdout;
-        }
+            FILE *out;
+            if (outfname) {
+                out = fopen(outfname, "w");
+
+                if (!f) {
+                    perror(ucoutfname);
+                    return 1;
+                }
+            } else {
+                out = stdout;
+            }
         
-        emit_instructions(out, verbose, format, secname);
+            if (pipeline)
+                out = pipeline_writer_open(out);
+
+            emit_instructions(out, verbose, format, secname);
+
+            if (pipeline)
+                fclose(out);
+        }
     }
     if (mmicrocode) {
         if (verbose) {
             printf("(generate microcode)\n");
         }
-        FILE *ucout;
-        if (ucoutfname) {
-            ucout = fopen(ucoutfname, "w");
-
-            if (!ucout) {
-                perror(ucoutfname);
+        if (banked) {
+            if (emit_banks_microcode(ucoutfname, format, &banks))
                 return 1;
+        } else {
+            FILE *ucout;
+            if (ucoutfname) {
+                ucout = fopen(ucoutfname, "w");
+
+                if (!ucout) {
+                    perror(ucoutfname);
+                    return 1;
+                }
+
+            } else {
+                ucout = stdout;
             }
 
-        } else {
-            ucout = stdout;
+            if (pipeline)
+                ucout = pipeline_writer_open(ucout);
+
+            if (nanofname) {
+                if (emit_nanocode(ucout, nanofname, verbose, format))
+                    return 1;
+            } else {
+                emit_microcode(ucout, verbose, format);
+            }
+
+            if (pipeline)
+                fclose(ucout);
         }
+    }
+    if (symfname) {
+        if (emit_symbols(symfname, secname))
+            return 1;
+    }
+    if (mwcet) {
+        if (analyse_wcet(wcet_path, secname, loop_bounds, n_loop_bounds))
+            return 1;
+    }
+    if (msimulate) {
+        if (simulate(sim_path, secname, jobs, sim_steps))
+            return 1;
+    }
+    if (n_targets) {
+        if (emit_targets(targets, n_targets, secname, verbose, jobs))
+            return 1;
+    }
+}
 
-        emit_microcode(ucout, verbose, format);
+int parse_format(char *s, emit_format *format) {
+    if (strcmp(s, "memh") == 0) {
+        *format = EF_MEMH;
+    } else if (strcmp(s, "memb") == 0) {
+        *format = EF_MEMB;
+    } else if (strcmp(s, "tuple") == 0) {
+        *format = EF_TUPLE;
+    } else if (strcmp(s, "bin") == 0) {
+        *format = EF_BIN;
+    } else if (strcmp(s, "sparse") == 0) {
+        *format = EF_SPARSE;
+    } else if (strcmp(s, "etf") == 0) {
+        *format = EF_ETF;
+    } else {
+        return 1;
     }
+
+    return 0;
+}
+
+//FORMAT=PATH, with a uc- prefix on FORMAT for microcode
+int add_emit_target(char *arg) {
+    char *s = strdup(arg);
+    char *path = strchr(s, '=');
+
+    if (!path || !path[1])
+        return 1;
+
+    *path++ = '\0';
+
+    emit_target t = { EF_MEMH, 0, path, 0 };
+    char *name = s;
+
+    if (strncmp(name, "uc-", 3) == 0) {
+        t.microcode = 1;
+        name += 3;
+    }
+
+    if (parse_format(name, &t.format))
+        return 1;
+
+    targets = realloc(targets, sizeof(*targets) * (n_targets + 1));
+    targets[n_targets++] = t;
+
+    return 0;
 }
 
 void warn() {
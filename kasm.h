@@ -5,18 +5,40 @@
 
 #define INST_OPCODE_BITS (11)
 
+//microcode words are bitsets as wide as \opt bits, up to this many bits
+#define UCODE_MAX_BITS (256)
+#define UCODE_LIMBS (UCODE_MAX_BITS / 64)
+
+//whole-word operations compile to SSE/AVX; aligned(8) since the words live in malloc'd structs
+typedef uint64_t ucode_vec __attribute__((vector_size(UCODE_MAX_BITS / 8), aligned(8)));
+
+typedef union {
+    uint64_t limb[UCODE_LIMBS];
+    ucode_vec v;
+} ucword;
+
 void warn();
 
+ucword ucword_zero();
+ucword ucword_bit(uint64_t bit);
+ucword ucword_or(ucword a, ucword b);
+int ucword_is_zero(ucword a);
+int ucword_overlaps(ucword a, ucword b);
+int ucword_test(ucword *a, uint64_t bit);
+uint64_t ucword_width(ucword a);
+uint64_t ucword_low(ucword a);
+
 typedef struct {
     char *ident;
-    uint64_t bits;
+    ucword bits;
 } bitdef;
 
-uint64_t create_bitdef(uint64_t bit);
-uint64_t merge_bitdef(uint64_t def, uint64_t bit);
-uint64_t merge_bitdef2(uint64_t def, uint64_t def2);
-void register_bitdef(char *ident, uint64_t def);
-uint64_t bitdef_lookup(char *ident);
+ucword create_bitdef(uint64_t bit);
+ucword merge_bitdef(ucword def, uint64_t bit);
+ucword merge_bitdef2(ucword def, ucword def2);
+void register_bitdef(char *ident, ucword def);
+ucword bitdef_lookup(char *ident);
+uint64_t get_bitdefs(bitdef ***table);
 void print_bitdefs();
 
 typedef struct s_tag {
@@ -31,25 +53,47 @@ tag* create_tag_ident(char *ident, char *value);
 tag* create_tag_numeric(char *ident, uint64_t value);
 tag* append_tag(tag *a, tag *b);
 
+struct s_idef_info;
+
 typedef struct {
     char *ident;
     uint64_t value;
-    uint64_t bits;
+    ucword bits;
     uint64_t n_operands;
     uint64_t n_immediates;
     tag *tags;
     uint64_t n_tags;
+    struct s_idef_info *info;
 } idef;
 
-void register_idef(char *ident, uint64_t bits, tag *tags);
+void register_idef(char *ident, ucword bits, tag *tags);
 idef* idef_lookup(char *ident);
 uint64_t get_definitions(idef ***table);
+uint64_t idef_index(idef *i);
+void reorder_definitions(uint64_t *position);
 void print_idefs();
 int has_tag(idef *i, char *ident, uint64_t *value_numeric, char **value_ident);
 
 void set_microcode_bits(uint64_t n);
+void replace_microcode_bits(uint64_t n);
 uint64_t get_microcode_bits();
 
+typedef struct {
+    uint64_t original_bits;
+    uint64_t bits;
+    uint64_t n_fields;
+    uint64_t offset[UCODE_MAX_BITS];
+    uint64_t width[UCODE_MAX_BITS];
+    uint64_t n_codes[UCODE_MAX_BITS];
+    int64_t field[UCODE_MAX_BITS];
+    uint64_t code[UCODE_MAX_BITS];
+} ucode_packing;
+
+ucode_packing* pack_microcode();
+ucword pack_encode(ucode_packing *p, ucword *bits);
+void pack_apply(ucode_packing *p);
+void print_packing(ucode_packing *p);
+
 void set_option(char *ident, uint64_t value);
 
 uint64_t create_offset(uint64_t offset);
@@ -78,6 +122,9 @@ typedef struct s_inst {
     char *immediate_ident;
     struct s_inst *next;
     uint64_t real_address;
+    uint64_t word;
+    int encoded;
+    uint64_t prefixes;
 } inst;
 
 typedef struct s_label {
@@ -88,6 +135,7 @@ typedef struct s_label {
 
 int verify_inst(inst *i);
 void register_inst(char *ident, operand *oper1, operand *oper2, operand *oper3, imm_type itype, uint64_t immediate, char *immediate_ident);
+int place_inst(char *ident, inst *i);
 inst* get_instructions();
 void print_instruction(FILE *f, inst *in, int real);
 
@@ -111,24 +159,33 @@ typedef struct {
     uint64_t n_insts;
     label **label_table;
     uint64_t n_labels;
+    uint32_t crc;
+    section_type type;
+    int64_t base_from;
 } section;
 
 void register_rel_address(uint64_t address);
 void register_abs_address(uint64_t address);
 
+uint64_t get_sections(section ***table);
 section* section_lookup(char *ident);
 section* section_lookup_reverse(char *ident);
 
 typedef struct {
     char *ident;
     uint64_t base;
+    section_type type;
+    int64_t base_from;
 } section_ident;
 
 section_ident* create_section_ident(char *ident, section_type type, uint64_t base, char *base_ident);
 
+void resolve_labels(section *s, int report);
 void register_section(section_ident *sident);
+void relayout_section(section *s, inst **table, uint64_t *address, uint64_t n, uint64_t *slot_address);
+void relayout_sections();
 
-typedef struct {
+typedef struct s_idef_info {
     uint64_t n_operands;
     uint64_t n_immediates;
     uint64_t label_allowed;
@@ -141,6 +198,75 @@ void print_sections_contents();
 
 extern int yylineno;
 
+int yyparse();
+void yyrestart(FILE *f);
+
+typedef enum {
+    FL_INST, FL_LABEL, FL_LOCAL_LABEL, FL_ABS_ADDRESS, FL_REL_ADDRESS
+} fast_line_type;
+
+typedef struct {
+    fast_line_type type;
+    int lineno;
+    char *ident;
+    uint64_t value;
+    inst *in;
+} fast_line;
+
+typedef struct {
+    inst in;
+    operand oper[3];
+} fast_inst;
+
+typedef struct {
+    char *ident;
+    section_type type;
+    uint64_t base;
+    char *base_ident;
+    int lineno;
+    int end_lineno;
+    fast_line *lines;
+    uint64_t n_lines;
+    fast_inst *insts;
+    char *arena;
+} fast_section;
+
+typedef enum {
+    CHUNK_TEXT, CHUNK_MICROCODE, CHUNK_SOURCE
+} chunk_type;
+
+typedef struct {
+    chunk_type type;
+    char *text;
+    uint64_t length;
+    int lineno;
+    fast_section *fast;
+    int done;
+    int skip;
+} chunk;
+
+typedef struct {
+    char *buf;
+    char *p;
+    char *start;
+    int lineno;
+    int start_lineno;
+    int in_comment;
+    chunk_type type;
+    chunk *chunks;
+    uint64_t n_chunks;
+} chunk_scanner;
+
+void scan_init(chunk_scanner *sc, char *buf);
+int scan_step(chunk_scanner *sc, char *end, int final);
+int parse_input(FILE *f, int fast, uint64_t jobs, char *only);
+uint64_t get_jobs(uint64_t jobs);
+int64_t scan_chunks(char *buf, uint64_t len, chunk **chunks);
+int parse_chunk(chunk *c);
+fast_section* fast_parse_source(chunk *c);
+void commit_fast_section(fast_section *fs);
+void free_fast_section(fast_section *fs);
+
 void preproc_define(char *s);
 int preproc_isdefined(char *s);
 void preproc_incdepth();
@@ -150,16 +276,388 @@ void yyerror(char *s, ...);
 
 void print_bin(FILE *f, uint64_t n, uint64_t bits);
 void print_hex(FILE *f, uint64_t n, uint64_t bits);
+void print_ucword_bin(FILE *f, ucword *w, uint64_t bits);
+void print_ucword_hex(FILE *f, ucword *w, uint64_t bits);
+void print_ucword_dec(FILE *f, ucword *w);
 
 typedef enum {
-    EF_MEMB, EF_MEMH, EF_TUPLE
+    EF_MEMB, EF_MEMH, EF_TUPLE, EF_BIN, EF_SPARSE, EF_ETF
 } emit_format;
 
+void emit_ucword(FILE *f, ucword *w, uint64_t bits, emit_format format);
 void emit_microcode(FILE *f, int verbose, emit_format format);
 void emit_instructions(FILE *f, int verbose, emit_format format, char *secname);
+int immediate_fits(inst *i);
 uint64_t encode_instruction(inst *i);
 uint64_t encode_offset(operand *o);
 void emit_tuple_operand(FILE *f, operand *o);
 void emit_tuple(FILE *f, inst *i);
+uint64_t inst_word(inst *i);
+
+typedef struct {
+    uint64_t size;
+    uint32_t *words;
+    uint64_t *valid;
+    inst **insts;
+    int mapped;
+    int fd;
+} image;
+
+typedef struct {
+    emit_format format;
+    int microcode;
+    char *path;
+    int failed;
+} emit_target;
+
+int parse_format(char *s, emit_format *format);
+int add_emit_target(char *arg);
+int section_selected(section *s, char *secname);
+image* image_create(char *path, char *secname, int with_insts);
+void image_place_section(image *img, section *s);
+void image_section_crc(image *img, section *s);
+int image_overlaps(char *secname);
+void image_build(image *img, char *secname, uint64_t jobs);
+int image_is_set(image *img, uint64_t addr);
+uint64_t image_next(image *img, uint64_t addr);
+void image_free(image *img);
+int emit_binary(char *path, char *secname, uint64_t jobs, int verbose);
+void emit_image(FILE *f, image *img, int verbose, emit_format format);
+int emit_targets(emit_target *targets, uint64_t n_targets, char *secname, int verbose, uint64_t jobs);
+
+typedef enum {
+    SPARSE_END, SPARSE_RUN, SPARSE_LITERAL, SPARSE_GAP
+} sparse_kind;
+
+uint64_t image_next_clear(image *img, uint64_t addr);
+void sparse_header(FILE *f, uint64_t size);
+void sparse_record(FILE *f, sparse_kind kind, uint64_t count, uint64_t addr);
+void sparse_literal(FILE *f, uint32_t *words, uint64_t from, uint64_t to);
+void sparse_extent(FILE *f, uint32_t *words, uint64_t from, uint64_t to);
+void emit_sparse(FILE *f, image *img);
+void sparse_mark(uint64_t *valid, uint64_t from, uint64_t to);
+int64_t sparse_load(FILE *f, uint32_t *mem, uint64_t *valid, uint64_t size);
+int64_t sparse_size(FILE *f);
+image* image_read(char *path);
+
+typedef enum {
+    CRC_NONE, CRC32, CRC32C
+} crc_kind;
+
+extern crc_kind checksum_kind;
+extern int64_t checksum_stamp;
+extern char *crc_names[];
+
+uint32_t crc_update(crc_kind kind, uint32_t crc, const void *buf, uint64_t len);
+uint32_t crc_combine(crc_kind kind, uint32_t crc1, uint32_t crc2, uint64_t len2);
+int section_base_cmp(const void *a, const void *b);
+uint32_t crc_zeros(crc_kind kind, uint32_t crc, uint64_t len);
+int crc_parse(char *s, crc_kind *kind);
+uint32_t image_crc(image *img, char *secname, crc_kind kind);
+void image_checksum(image *img, char *secname);
+
+void emit_etf(FILE *f, image *img);
+
+typedef struct {
+    uint64_t *slices;
+    uint64_t n_slices;
+    uint64_t interleave;
+} bank_layout;
+
+typedef struct {
+    uint64_t size;
+    uint64_t bits;
+    uint64_t *words;
+    uint64_t limbs;
+    uint64_t *valid;
+} bank_source;
+
+int parse_bank_slices(char *s, bank_layout *layout);
+void bank_extract(uint64_t *dst, uint64_t *src, uint64_t n, uint64_t stride, uint64_t limbs, uint64_t lo, uint64_t width);
+int emit_banks(char *path, bank_source *src, bank_layout *layout, emit_format format);
+int emit_banks_image(char *path, char *secname, uint64_t jobs, emit_format format, bank_layout *layout);
+int emit_banks_microcode(char *path, emit_format format, bank_layout *layout);
+
+typedef struct {
+    ucword *words;
+    uint64_t n_words;
+    uint64_t *index;
+    uint64_t index_bits;
+} nanocode;
+
+nanocode* build_nanocode();
+void emit_nanocode_table(FILE *f, nanocode *n, int verbose, emit_format format);
+void emit_nanocode_index(FILE *f, nanocode *n, int verbose, emit_format format);
+int emit_nanocode(FILE *f, char *path, int verbose, emit_format format);
+
+typedef struct {
+    uint64_t n;
+    uint64_t *count;
+    uint64_t *trans;
+} opcode_usage;
+
+opcode_usage* usage_create();
+void usage_free(opcode_usage *u);
+void usage_count(opcode_usage *u, int64_t prev, uint64_t i);
+void usage_add_program(opcode_usage *u);
+int usage_add_image(opcode_usage *u, char *path);
+uint64_t usage_switching(opcode_usage *u, uint64_t *code);
+uint64_t* remap_assign(opcode_usage *u);
+void remap_opcodes(opcode_usage *u);
+
+//room for the three widest operands, the immediate and the address
+#define DECODE_MAX_LINE (96)
+#define DECODE_BLOCK (4096)
+
+typedef struct {
+    idef *def;
+    uint64_t n_operands;
+    imm_type type;
+    uint64_t name_len;
+} decode_entry;
+
+typedef struct {
+    decode_entry entry[1 << INST_OPCODE_BITS];
+    char operand_text[128][16];
+    uint64_t operand_len[128];
+    uint64_t max_line;
+} decode_table;
+
+decode_table* build_decode_table();
+int decode_instruction(decode_table *t, uint32_t word, inst *in, operand ops[3]);
+uint64_t disassemble_word(decode_table *t, uint32_t word, uint64_t address, char *buf);
+int disassemble_sparse(char *path, FILE *out);
+int disassemble(char *path, FILE *out, emit_format format);
+
+#define SIM_MEMORY_WORDS (1 << 16)
+
+//in the order of sim_names
+typedef enum {
+    SIM_NOP, SIM_MOV, SIM_ADD, SIM_SUB, SIM_AND, SIM_OR, SIM_XOR, SIM_SHL, SIM_SHR,
+    SIM_ADDI, SIM_LDI, SIM_JMP, SIM_JZ, SIM_JNZ, SIM_HALT, SIM_FAULT
+} sim_kind;
+
+typedef struct {
+    uint8_t base;
+    uint8_t depth;
+    uint8_t off1;
+    uint8_t off2;
+} sim_operand;
+
+typedef struct {
+    void *handler;
+    sim_kind kind;
+    sim_operand o[3];
+    uint32_t imm;
+    uint64_t target;
+} sim_inst;
+
+typedef struct {
+    uint32_t reg[16];
+    uint32_t *mem;
+    uint64_t pc;
+    uint64_t steps;
+    uint64_t size;
+    uint64_t *counts;
+    sim_inst *code;
+} sim_state;
+
+extern char *sim_names[];
+
+sim_kind sim_kind_of(idef *def, uint64_t n_operands);
+void sim_decode_range(sim_inst *code, image *img, decode_table *t, sim_kind *kinds, uint8_t *prefix,
+                      uint64_t from, uint64_t to, uint64_t base);
+sim_inst* sim_predecode(image *img, char *secname);
+sim_kind sim_run(sim_state *st, uint64_t max_steps);
+void print_label_counts(sim_state *st, char *secname);
+int simulate(char *path, char *secname, uint64_t jobs, uint64_t max_steps);
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t n_sections;
+    uint64_t n_labels;
+    uint64_t strings_size;
+} symbol_header;
+
+typedef struct {
+    uint64_t address;
+    uint64_t end;
+    uint32_t name;
+    uint32_t section;
+} symbol_entry;
+
+typedef struct {
+    void *map;
+    uint64_t size;
+    symbol_entry *sections;
+    uint64_t n_sections;
+    symbol_entry *labels;
+    uint64_t n_labels;
+    char *strings;
+} symbol_index;
+
+int emit_symbols(char *path, char *secname);
+symbol_index* symbol_open(char *path);
+void symbol_close(symbol_index *idx);
+symbol_entry* symbol_search(symbol_entry *table, uint64_t n, uint64_t address);
+symbol_entry* symbol_lookup(symbol_index *idx, uint64_t address);
+symbol_entry* symbol_section(symbol_index *idx, uint64_t address);
+char* symbol_name(symbol_index *idx, symbol_entry *e);
+int symbolize(char *path);
+
+typedef enum {
+    FLOW_NEXT, FLOW_JUMP, FLOW_BRANCH, FLOW_HALT
+} wcet_flow;
+
+typedef struct {
+    section *sec;
+    uint64_t first;
+    uint64_t end;
+    uint64_t address;
+    uint64_t cycles;
+    uint64_t succ[2];
+    uint64_t n_succ;
+    uint64_t bound;
+    char *name;
+} wcet_block;
+
+uint64_t inst_cycles(idef *def);
+wcet_flow inst_flow(idef *def);
+int section_has_fixed_jumps(section *s);
+void build_wcet_blocks(char *secname);
+int set_loop_bound(char *arg);
+uint64_t wcet_longest(int64_t region, uint64_t entry, int ignore_entry, int64_t target, int report);
+uint64_t wcet_into_loop(uint64_t *members, uint64_t n, uint64_t header, uint64_t target);
+void print_wcet_blocks();
+int analyse_wcet(char *path, char *secname, char **loop_bounds, uint64_t n_loop_bounds);
+
+#define SCHED_WINDOW (64)
+#define SCHED_UNITS (64)
+
+typedef struct {
+    uint64_t latency;
+    uint64_t busy;
+    int64_t unit;
+    wcet_flow flow;
+    int reads_first;
+    int writes_first;
+} sched_def;
+
+typedef struct {
+    uint16_t reads;
+    uint16_t writes;
+    uint8_t mem_read;
+    uint8_t mem_write;
+} sched_effect;
+
+typedef struct {
+    inst **insts;
+    uint64_t n;
+    sched_effect effect[SCHED_WINDOW];
+    int64_t dist[SCHED_WINDOW][SCHED_WINDOW];
+    uint64_t reg_ready[16];
+    uint64_t unit_free[SCHED_UNITS];
+} sched_block;
+
+void build_sched_defs();
+sched_effect sched_effect_of(inst *in);
+uint64_t sched_issue(sched_block *b, uint64_t *order, inst ***out, uint64_t *n_out, uint64_t *stalls);
+void sched_dependences(sched_block *b);
+void sched_list(sched_block *b, uint64_t *order);
+void sched_block_run(sched_block *b, inst ***out, uint64_t *n_out);
+void schedule_section(section *s);
+void schedule_program();
+
+typedef enum {
+    PEEP_SELF_MOVE, PEEP_JUMP_NEXT, PEEP_REPEAT, PEEP_MOVE_PAIR, PEEP_CANCEL, PEEP_PATTERNS
+} peep_pattern;
+
+typedef struct {
+    wcet_flow flow;
+    int64_t kind;
+    int move;
+    int jump;
+    int idempotent;
+    idef *cancels;
+} peep_def;
+
+void build_peep_defs();
+int same_operand(operand *a, operand *b);
+int same_operands(inst *a, inst *b);
+int is_idempotent(inst *in);
+int is_noop(inst *in);
+int peep_pair(inst *a, inst *b);
+uint64_t peephole_sweep(section *s);
+void peephole_program();
+
+typedef struct {
+    uint64_t n_blocks;
+    uint64_t *start;
+    uint64_t *first;
+    uint8_t *live;
+    int whole;
+} dead_section;
+
+void build_dead_section(section *s, dead_section *d);
+uint64_t dead_block_of(dead_section *d, uint64_t address);
+void dead_mark(uint64_t sec, uint64_t block);
+label* dead_find_global(section *s, char *ident);
+void dead_follow(section **sections, uint64_t n_sections, uint64_t sec, inst *in);
+int dead_mark_entry(section **sections, uint64_t n_sections, char *name);
+void dead_prune_labels(section *s, dead_section *d);
+uint64_t dead_strip_section(section *s, dead_section *d);
+int eliminate_dead_code(char **entries, uint64_t n_entries);
+
+typedef struct {
+    section *sec;
+    uint64_t start;
+    uint64_t end;
+    uint64_t first;
+    uint64_t n;
+    uint64_t label;
+    uint64_t hash;
+    int foldable;
+    int64_t canonical;
+    int64_t folded;
+    int64_t next_folded;
+} fold_block;
+
+int fold_internal(fold_block *b, inst *in);
+uint64_t fold_hash_operand(uint64_t h, operand *o);
+uint64_t fold_hash(fold_block *b);
+int fold_same(fold_block *a, fold_block *b);
+int fold_external(fold_block *b);
+void build_fold_blocks(section *s);
+int64_t fold_find(uint64_t i);
+uint64_t fold_section(section *s);
+uint64_t fold_count_across(section **sections, uint64_t n_sections);
+void fold_program();
+
+typedef struct {
+    uint64_t base;
+    uint64_t end;
+    int hot;
+} place_span;
+
+int64_t place_section_at(section **sections, uint64_t n_sections, uint64_t address);
+char* place_trim(char *p);
+int read_profile(char *path, section **sections, uint64_t n_sections, uint64_t *unmatched);
+int place_span_cmp(const void *a, const void *b);
+void place_spread(section **sections, uint64_t n_sections, uint64_t *spread, uint64_t *runs);
+uint64_t place_run(section **sections, uint64_t n_sections, uint64_t head, uint64_t end);
+int place_sections(char *path);
+
+void build_relax_defs();
+uint64_t relax_width(inst *in);
+uint64_t relax_prefixes_needed(inst *in);
+int relax_widen(inst *in);
+uint64_t relax_section(section *s);
+void relax_program();
+
+int emit_delta(char *old_path, char *path, char *secname, uint64_t jobs, int verbose);
+
+int parse_input_pipelined(FILE *f, int encode, char *only);
+FILE* pipeline_writer_open(FILE *out);
 
 #endif /* KASM_H */
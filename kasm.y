@@ -7,6 +7,7 @@
 
 %union {
     uint64_t llu;
+    ucword bits;
     char *text;
     tag *t;
     operand *o;
@@ -19,7 +20,8 @@
 %token COMMA LP RP LB RB LS RS EQ EOL PERCENT COLON AT PLUS DOT REGMARK OPTION TILDE
 
 %type <text> any_ident
-%type <llu> bitdef_bits idef_bits idef_bits_list offset base
+%type <llu> offset base
+%type <bits> bitdef_bits idef_bits idef_bits_list
 %type <t> idef_tag_list idef_tag_term idef_tag
 %type <o> operand
 %type <sident> src_section_ident
@@ -64,7 +66,7 @@ bitdef_exp EOL
 ;
 
 bitdef_exp:
-PERCENT IDENT_CAPS TILDE { register_bitdef($2, 0); }
+PERCENT IDENT_CAPS TILDE { register_bitdef($2, ucword_zero()); }
 | PERCENT IDENT_CAPS bitdef_bits { register_bitdef($2, $3); }
 ;
 
@@ -87,7 +89,7 @@ LP idef_bits_list RP { $$ = $2; }
 ;
 
 idef_bits_list:
-%empty { $$ = 0; }
+%empty { $$ = ucword_zero(); }
 | NUMERIC { $$ = create_bitdef($1); }
 | IDENT_CAPS { $$ = bitdef_lookup($1); }
 | idef_bits_list COMMA NUMERIC { $$ = merge_bitdef($1, $3); }
@@ -108,7 +110,7 @@ idef_tag_term:
 any_ident { $$ = create_tag_empty($1); }
 | any_ident EQ any_ident { $$ = create_tag_ident($1, $3); }
 | any_ident EQ NUMERIC { $$ = create_tag_numeric($1, $3); }
-| any_ident EQ idef_bits { $$ = create_tag_numeric($1, $3); }
+| any_ident EQ idef_bits { $$ = create_tag_numeric($1, ucword_low($3)); }
 ;
 
 
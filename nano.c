@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "kasm.h"
+
+/*
+ * Two-level control store: every distinct microword is stored once in a
+ * nanocode table, and a narrow index ROM, addressed by the opcode value
+ * from register_idef, selects the nanoword for each instruction.
+ */
+
+uint64_t hash_ucword(ucword *w) {
+    uint64_t h = 14695981039346656037LU;
+
+    for (int i = 0; i < UCODE_LIMBS; i++) {
+        h ^= w->limb[i];
+        h *= 1099511628211LU;
+        h ^= h >> 29;
+    }
+
+    return h;
+}
+
+//nanowords are numbered in order of first use
+nanocode* build_nanocode() {
+    idef **table;
+    uint64_t n_idefs = get_definitions(&table);
+
+    nanocode *n = calloc(1, sizeof(*n));
+    n->words = malloc(sizeof(*n->words) * (n_idefs + 1));
+    n->index = malloc(sizeof(*n->index) * (n_idefs + 1));
+
+    uint64_t size = 64;
+    while (size < n_idefs * 2)
+        size <<= 1;
+
+    //slots hold a nanoword number plus one, 0 when empty
+    uint64_t *slots = calloc(size, sizeof(*slots));
+
+    for (uint64_t i = 0; i < n_idefs; i++) {
+        ucword *w = &table[i]->bits;
+        uint64_t h = hash_ucword(w) & (size - 1);
+
+        while (slots[h] && memcmp(&n->words[slots[h] - 1], w, sizeof(*w)) != 0)
+            h = (h + 1) & (size - 1);
+
+        if (!slots[h]) {
+            n->words[n->n_words] = *w;
+            slots[h] = ++n->n_words;
+        }
+
+        n->index[i] = slots[h] - 1;
+    }
+
+    free(slots);
+
+    n->index_bits = 1;
+    while ((1LU << n->index_bits) < n->n_words)
+        n->index_bits++;
+
+    return n;
+}
+
+int idef_value_cmp(const void *a, const void *b) {
+    idef *x = **(idef***)a;
+    idef *y = **(idef***)b;
+
+    return (x->value > y->value) - (x->value < y->value);
+}
+
+void emit_nanocode_table(FILE *f, nanocode *n, int verbose, emit_format format) {
+    idef **table;
+    uint64_t n_idefs = get_definitions(&table);
+
+    for (uint64_t k = 0; k < n->n_words; k++) {
+        emit_ucword(f, &n->words[k], get_microcode_bits(), format);
+
+        if (format == EF_BIN)
+            continue;
+
+        if (verbose) {
+            fprintf(f, " // %lu --", k);
+            for (uint64_t i = 0; i < n_idefs; i++) {
+                if (n->index[i] == k)
+                    fprintf(f, " %s", table[i]->ident);
+            }
+        }
+        fprintf(f, "\n");
+    }
+}
+
+void emit_nanocode_index(FILE *f, nanocode *n, int verbose, emit_format format) {
+    idef **table;
+    uint64_t n_idefs = get_definitions(&table);
+
+    //sorted by opcode value, which reserved bits can make sparse
+    idef ***order = malloc(sizeof(*order) * (n_idefs + 1));
+    for (uint64_t i = 0; i < n_idefs; i++)
+        order[i] = &table[i];
+    qsort(order, n_idefs, sizeof(*order), idef_value_cmp);
+
+    uint64_t next = 0;
+
+    for (uint64_t k = 0; k < n_idefs; k++) {
+        uint64_t i = order[k] - table;
+        ucword w = ucword_zero();
+
+        if (format == EF_BIN) {
+            //gaps are zero, as in the raw instruction image
+            for (; next < table[i]->value; next++)
+                emit_ucword(f, &w, n->index_bits, format);
+        } else if (table[i]->value != next) {
+            fprintf(f, "@ ");
+            print_hex(f, table[i]->value, 0);
+            fprintf(f, "\n");
+        }
+
+        w.limb[0] = n->index[i];
+        emit_ucword(f, &w, n->index_bits, format);
+        next = table[i]->value + 1;
+
+        if (format == EF_BIN)
+            continue;
+
+        if (verbose)
+            fprintf(f, " // %lu -- %s", table[i]->value, table[i]->ident);
+        fprintf(f, "\n");
+    }
+
+    free(order);
+}
+
+//the index ROM goes to f, the nanocode table to path
+int emit_nanocode(FILE *f, char *path, int verbose, emit_format format) {
+    nanocode *n = build_nanocode();
+
+    idef **table;
+    uint64_t n_idefs = get_definitions(&table);
+    uint64_t bits = get_microcode_bits();
+
+    fprintf(stderr, "(nanocode: %lu microwords of %lu bits = %lu bits -> %lu nanowords + %lu indices of %lu bits = %lu bits)\n",
+            n_idefs, bits, n_idefs * bits,
+            n->n_words, n_idefs, n->index_bits, n->n_words * bits + n_idefs * n->index_bits);
+
+    FILE *nf = fopen(path, "w");
+    int r = 0;
+
+    if (!nf) {
+        perror(path);
+        r = 1;
+    } else {
+        emit_nanocode_table(nf, n, verbose, format);
+
+        if (fclose(nf)) {
+            perror(path);
+            r = 1;
+        }
+    }
+
+    if (!r)
+        emit_nanocode_index(f, n, verbose, format);
+
+    free(n->words);
+    free(n->index);
+    free(n);
+
+    return r;
+}
@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "kasm.h"
+
+/*
+ * Microcode field packing. Every used bit position is a signal; bits that
+ * are set by exactly the same instructions are one signal driven to all of
+ * them. Signals that no instruction sets together are gathered into one
+ * binary-encoded field, with code 0 meaning none of them. Decoding is one
+ * comparison per original bit: bit b is set when field[b] holds code[b].
+ */
+
+//bits needed to hold the codes 0..n
+uint64_t pack_code_bits(uint64_t n) {
+    return n ? 64 - __builtin_clzl(n) : 0;
+}
+
+ucode_packing* pack_microcode() {
+    idef **table;
+    uint64_t n_idefs = get_definitions(&table);
+    uint64_t cw = (n_idefs + 63) / 64;
+
+    //column b holds the instructions that set bit b
+    uint64_t *cols = calloc(UCODE_MAX_BITS * cw + 1, sizeof(*cols));
+
+    for (uint64_t i = 0; i < n_idefs; i++) {
+        for (uint64_t b = 0; b < UCODE_MAX_BITS; b++) {
+            if (ucword_test(&table[i]->bits, b))
+                cols[b * cw + (i >> 6)] |= 1LU << (i & 63);
+        }
+    }
+
+    ucode_packing *p = calloc(1, sizeof(*p));
+    p->original_bits = get_microcode_bits();
+
+    int64_t signal_of[UCODE_MAX_BITS];
+    uint64_t signal_bit[UCODE_MAX_BITS];
+    uint64_t n_signals = 0;
+
+    for (uint64_t b = 0; b < UCODE_MAX_BITS; b++) {
+        signal_of[b] = -1;
+
+        uint64_t *c = &cols[b * cw];
+        uint64_t used = 0;
+
+        for (uint64_t k = 0; k < cw; k++)
+            used |= c[k];
+
+        if (!used)
+            continue;
+
+        for (uint64_t s = 0; s < n_signals && signal_of[b] < 0; s++) {
+            if (memcmp(c, &cols[signal_bit[s] * cw], cw * sizeof(*c)) == 0)
+                signal_of[b] = s;
+        }
+
+        if (signal_of[b] < 0) {
+            signal_bit[n_signals] = b;
+            signal_of[b] = n_signals++;
+        }
+    }
+
+    //two signals conflict when some instruction sets both
+    uint8_t *conflict = calloc(n_signals * n_signals + 1, 1);
+    uint64_t degree[UCODE_MAX_BITS] = { 0 };
+
+    for (uint64_t s = 0; s < n_signals; s++) {
+        for (uint64_t t = s + 1; t < n_signals; t++) {
+            uint64_t *a = &cols[signal_bit[s] * cw];
+            uint64_t *c = &cols[signal_bit[t] * cw];
+
+            for (uint64_t k = 0; k < cw; k++) {
+                if (a[k] & c[k]) {
+                    conflict[s * n_signals + t] = conflict[t * n_signals + s] = 1;
+                    degree[s]++;
+                    degree[t]++;
+                    break;
+                }
+            }
+        }
+    }
+
+    //most constrained signals first, each into the largest field it fits
+    uint64_t order[UCODE_MAX_BITS];
+
+    for (uint64_t s = 0; s < n_signals; s++) {
+        uint64_t j = s;
+        for (; j > 0 && degree[order[j - 1]] < degree[s]; j--)
+            order[j] = order[j - 1];
+        order[j] = s;
+    }
+
+    int64_t field_of[UCODE_MAX_BITS];
+    uint64_t code_of[UCODE_MAX_BITS];
+
+    for (uint64_t s = 0; s < n_signals; s++)
+        field_of[s] = -1;
+
+    for (uint64_t k = 0; k < n_signals; k++) {
+        uint64_t s = order[k];
+        int64_t best = -1;
+
+        for (uint64_t f = 0; f < p->n_fields; f++) {
+            int fits = 1;
+
+            for (uint64_t t = 0; t < n_signals && fits; t++) {
+                if (field_of[t] == (int64_t)f && conflict[s * n_signals + t])
+                    fits = 0;
+            }
+
+            if (fits && (best < 0 || p->n_codes[f] > p->n_codes[best]))
+                best = f;
+        }
+
+        if (best < 0) {
+            best = p->n_fields++;
+            p->n_codes[best] = 0;
+        }
+
+        field_of[s] = best;
+        code_of[s] = ++p->n_codes[best];
+    }
+
+    for (uint64_t f = 0; f < p->n_fields; f++) {
+        p->offset[f] = p->bits;
+        p->width[f] = pack_code_bits(p->n_codes[f]);
+        p->bits += p->width[f];
+    }
+
+    for (uint64_t b = 0; b < UCODE_MAX_BITS; b++) {
+        p->field[b] = (signal_of[b] < 0) ? -1 : field_of[signal_of[b]];
+        p->code[b] = (signal_of[b] < 0) ? 0 : code_of[signal_of[b]];
+    }
+
+    free(conflict);
+    free(cols);
+
+    return p;
+}
+
+ucword pack_encode(ucode_packing *p, ucword *bits) {
+    ucword w = ucword_zero();
+
+    //signals sharing a field are exclusive, so every set bit of a field yields the same code
+    for (uint64_t b = 0; b < UCODE_MAX_BITS; b++) {
+        if (p->field[b] < 0 || !ucword_test(bits, b))
+            continue;
+
+        uint64_t off = p->offset[p->field[b]];
+
+        for (uint64_t k = 0; k < p->width[p->field[b]]; k++) {
+            if ((p->code[b] >> k) & 1)
+                w = ucword_or(w, ucword_bit(off + k));
+        }
+    }
+
+    return w;
+}
+
+//rewrites every instruction definition with the packed encoding
+void pack_apply(ucode_packing *p) {
+    idef **table;
+    uint64_t n_idefs = get_definitions(&table);
+
+    for (uint64_t i = 0; i < n_idefs; i++)
+        table[i]->bits = pack_encode(p, &table[i]->bits);
+
+    replace_microcode_bits(p->bits);
+}
+
+void print_packing(ucode_packing *p) {
+    bitdef **bitdefs;
+    uint64_t n_bitdefs = get_bitdefs(&bitdefs);
+
+    printf("packed microcode: %lu -> %lu bits\n", p->original_bits, p->bits);
+
+    for (uint64_t f = 0; f < p->n_fields; f++) {
+        printf("field %lu: bits %lu-%lu\n", f, p->offset[f], p->offset[f] + p->width[f] - 1);
+
+        for (uint64_t c = 1; c <= p->n_codes[f]; c++) {
+            printf("  %lu =", c);
+
+            for (uint64_t b = 0; b < UCODE_MAX_BITS; b++) {
+                if (p->field[b] == (int64_t)f && p->code[b] == c)
+                    printf(" %lu", b);
+            }
+
+            //bitdefs wholly decoded from this code
+            for (uint64_t d = 0; d < n_bitdefs; d++) {
+                ucword *bits = &bitdefs[d]->bits;
+                int all = !ucword_is_zero(*bits);
+
+                for (uint64_t b = 0; b < UCODE_MAX_BITS && all; b++) {
+                    if (ucword_test(bits, b) && (p->field[b] != (int64_t)f || p->code[b] != c))
+                        all = 0;
+                }
+
+                if (all)
+                    printf(" %s", bitdefs[d]->ident);
+            }
+
+            printf("\n");
+        }
+    }
+}
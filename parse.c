@@ -0,0 +1,809 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "kasm.h"
+#include "kasm.tab.h"
+
+/*
+ * Input is split into chunks at each microcode:/source: header. Source
+ * chunks go through a hand-written parser that mirrors the grammar of
+ * src_section in kasm.y and writes straight into preallocated instruction
+ * storage; anything it does not understand (or anything that would make
+ * the bison actions warn) is left to yyparse instead, as are microcode
+ * chunks.
+ */
+
+typedef struct {
+    char *p;
+    char *end;
+    int lineno;
+    int bol;
+    char *text;
+    uint64_t len;
+    uint64_t llu;
+} fast_lexer;
+
+#define IS_DIGIT(c) ((c) >= '0' && (c) <= '9')
+#define IS_UPPER(c) ((c) >= 'A' && (c) <= 'Z')
+#define IS_ALPHA(c) (IS_UPPER(c) || ((c) >= 'a' && (c) <= 'z'))
+#define IS_HEX(c) (IS_DIGIT(c) || ((c) >= 'a' && (c) <= 'f') || ((c) >= 'A' && (c) <= 'F'))
+
+uint64_t fast_keyword(char *p, char *end, char *kw) {
+    uint64_t n = strlen(kw);
+
+    if ((uint64_t)(end - p) >= n && memcmp(p, kw, n) == 0)
+        return n;
+
+    return 0;
+}
+
+//returns a token from kasm.tab.h, 0 at end of input or -1 for anything kasm.l would not accept silently
+int fast_lex(fast_lexer *lx) {
+    while (lx->p < lx->end) {
+        char *p = lx->p;
+        char c = *p;
+
+        if (c == ' ' || c == '\t') {
+            while (lx->p < lx->end && (*lx->p == ' ' || *lx->p == '\t'))
+                lx->p++;
+            lx->bol = 0;
+            continue;
+        }
+
+        if (c == ';') {
+            while (lx->p < lx->end && *lx->p != '\n')
+                lx->p++;
+            lx->bol = 0;
+            continue;
+        }
+
+        if (c == '\n') {
+            lx->p++;
+            lx->lineno++;
+            if (lx->bol)
+                continue;
+            lx->bol = 1;
+            return EOL;
+        }
+
+        lx->bol = 0;
+        lx->text = p;
+
+        //longest match, ties going to the rule listed first in kasm.l
+        uint64_t best = 0, n;
+        int tok = -1, base = 0;
+
+        if (c == 's' && (n = fast_keyword(p, lx->end, "source:")) > best) {
+            best = n;
+            tok = ENTER_SOURCE;
+        }
+        if (c == 'm' && (n = fast_keyword(p, lx->end, "microcode:")) > best) {
+            best = n;
+            tok = ENTER_MICROCODE;
+        }
+
+        for (n = 0; p + n < lx->end && IS_HEX(p[n]); n++);
+        if (n && p + n < lx->end && p[n] == 'h' && n + 1 > best) {
+            best = n + 1;
+            tok = NUMERIC;
+            base = 16;
+        }
+
+        for (n = 0; p + n < lx->end && (p[n] == '0' || p[n] == '1'); n++);
+        if (n && p + n < lx->end && p[n] == 'b' && n + 1 > best) {
+            best = n + 1;
+            tok = NUMERIC;
+            base = 2;
+        }
+
+        for (n = 0; p + n < lx->end && IS_DIGIT(p[n]); n++);
+        if (n && p + n < lx->end && p[n] == 'd')
+            n++;
+        if (n > best) {
+            best = n;
+            tok = NUMERIC;
+            base = 10;
+        }
+
+        if (IS_UPPER(c)) {
+            for (n = 1; p + n < lx->end && (IS_UPPER(p[n]) || IS_DIGIT(p[n]) || p[n] == '_'); n++);
+            if (n > best) {
+                best = n;
+                tok = IDENT_CAPS;
+            }
+        }
+
+        if (IS_ALPHA(c)) {
+            for (n = 1; p + n < lx->end && (IS_ALPHA(p[n]) || IS_DIGIT(p[n]) || p[n] == '.' || p[n] == '_'); n++);
+            if (n > best) {
+                best = n;
+                tok = IDENT;
+            }
+        }
+
+        if (best) {
+            lx->p += best;
+            lx->len = best;
+            if (tok == NUMERIC)
+                lx->llu = strtoull(p, NULL, base);
+            return tok;
+        }
+
+        lx->p++;
+        lx->len = 1;
+
+        switch (c) {
+            case '%':
+                if (lx->p < lx->end && *lx->p == 'r') {
+                    lx->p++;
+                    lx->len = 2;
+                    return REGMARK;
+                }
+                return PERCENT;
+            case '\\':
+                if (fast_keyword(lx->p, lx->end, "opt")) {
+                    lx->p += 3;
+                    lx->len = 4;
+                    return OPTION;
+                }
+                return -1;
+            case ',': return COMMA;
+            case '=': return EQ;
+            case ':': return COLON;
+            case '@': return AT;
+            case '+': return PLUS;
+            case '.': return DOT;
+            case '~': return TILDE;
+            case '(': return LP;
+            case ')': return RP;
+            case '{': return LB;
+            case '}': return RB;
+            case '[': return LS;
+            case ']': return RS;
+            default:
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+char* fast_ident(fast_lexer *lx, char **arena) {
+    char *s = *arena;
+
+    memcpy(s, lx->text, lx->len);
+    s[lx->len] = '\0';
+    *arena += lx->len + 1;
+
+    return s;
+}
+
+//operand: REGMARK NUMERIC [LS NUMERIC RS [LS NUMERIC RS]], only values that create_operand/create_offset accept as-is
+int fast_operand(fast_lexer *lx, operand *o) {
+    if (fast_lex(lx) != NUMERIC || lx->llu > 15)
+        return -1;
+
+    o->base = lx->llu;
+    o->offset1 = 0;
+    o->offset2 = 0;
+
+    int tok = fast_lex(lx);
+
+    for (int k = 0; k < 2 && tok == LS; k++) {
+        if (fast_lex(lx) != NUMERIC || lx->llu > 1)
+            return -1;
+        if (k == 0)
+            o->offset1 = lx->llu + 1;
+        else
+            o->offset2 = lx->llu + 1;
+        if (fast_lex(lx) != RS)
+            return -1;
+        tok = fast_lex(lx);
+    }
+
+    return tok;
+}
+
+int fast_section_header(fast_lexer *lx, fast_section *fs, char **arena) {
+    fs->ident = NULL;
+    fs->type = REL_AUTO;
+    fs->base = 0;
+    fs->base_ident = NULL;
+
+    int tok = fast_lex(lx);
+
+    if (tok != LB)
+        return tok;
+
+    tok = fast_lex(lx);
+
+    if (tok == NUMERIC) {
+        fs->type = ABS;
+        fs->base = lx->llu;
+    } else if (tok == PLUS) {
+        tok = fast_lex(lx);
+        if (tok != IDENT && tok != IDENT_CAPS)
+            return -1;
+        fs->type = REL_IDENT;
+        fs->ident = fast_ident(lx, arena);
+        fs->base_ident = fs->ident;
+    } else if (tok == IDENT || tok == IDENT_CAPS) {
+        fs->ident = fast_ident(lx, arena);
+        if ((tok = fast_lex(lx)) == RB)
+            return fast_lex(lx);
+        if (tok != COMMA)
+            return -1;
+
+        tok = fast_lex(lx);
+        if (tok == NUMERIC) {
+            fs->type = ABS;
+            fs->base = lx->llu;
+        } else if (tok == PLUS) {
+            tok = fast_lex(lx);
+            if (tok != IDENT && tok != IDENT_CAPS)
+                return -1;
+            fs->type = REL_IDENT;
+            fs->base_ident = fast_ident(lx, arena);
+        } else {
+            return -1;
+        }
+    } else {
+        return -1;
+    }
+
+    if (fast_lex(lx) != RB)
+        return -1;
+
+    return fast_lex(lx);
+}
+
+//one line of src_section; returns the token following its EOL, or -1
+int fast_statement(fast_lexer *lx, int tok, fast_line *line, fast_inst *slot, char **arena) {
+    line->lineno = lx->lineno;
+    line->in = NULL;
+
+    if (tok == AT) {
+        tok = fast_lex(lx);
+        line->type = FL_ABS_ADDRESS;
+        if (tok == PLUS) {
+            line->type = FL_REL_ADDRESS;
+            tok = fast_lex(lx);
+        }
+        if (tok != NUMERIC)
+            return -1;
+        line->value = lx->llu;
+        if (fast_lex(lx) != COLON || fast_lex(lx) != EOL)
+            return -1;
+        return fast_lex(lx);
+    }
+
+    if (tok == DOT) {
+        tok = fast_lex(lx);
+        if (tok != IDENT && tok != IDENT_CAPS)
+            return -1;
+        line->type = FL_LOCAL_LABEL;
+        line->ident = fast_ident(lx, arena);
+        if (fast_lex(lx) != COLON || fast_lex(lx) != EOL)
+            return -1;
+        return fast_lex(lx);
+    }
+
+    if (tok != IDENT && tok != IDENT_CAPS)
+        return -1;
+
+    line->ident = fast_ident(lx, arena);
+
+    tok = fast_lex(lx);
+
+    if (tok == COLON) {
+        line->type = FL_LABEL;
+        if (fast_lex(lx) != EOL)
+            return -1;
+        return fast_lex(lx);
+    }
+
+    inst *in = &slot->in;
+    operand **oper[3] = { &in->oper1, &in->oper2, &in->oper3 };
+
+    line->type = FL_INST;
+    line->in = in;
+    in->oper1 = NULL;
+    in->oper2 = NULL;
+    in->oper3 = NULL;
+    in->type = NONE;
+    in->immediate = 0;
+    in->immediate_ident = NULL;
+    in->encoded = 0;
+    in->prefixes = 0;
+
+    for (int k = 0; k < 3 && tok == REGMARK; k++) {
+        *oper[k] = &slot->oper[k];
+        tok = fast_operand(lx, &slot->oper[k]);
+
+        if (tok != COMMA)
+            break;
+
+        tok = fast_lex(lx);
+
+        if (k == 0 && tok == NUMERIC) {
+            in->type = DOUBLE;
+            in->immediate = lx->llu;
+            tok = fast_lex(lx);
+            break;
+        } else if (k == 0 && tok == COLON) {
+            in->type = GLOBAL_LABEL;
+            tok = fast_lex(lx);
+            if (tok == DOT) {
+                in->type = LOCAL_LABEL;
+                tok = fast_lex(lx);
+            }
+            if (tok != IDENT && tok != IDENT_CAPS)
+                return -1;
+            in->immediate_ident = fast_ident(lx, arena);
+            tok = fast_lex(lx);
+            break;
+        } else if (k == 1 && tok == NUMERIC) {
+            in->type = SINGLE;
+            in->immediate = lx->llu;
+            tok = fast_lex(lx);
+            break;
+        } else if (tok != REGMARK || k == 2) {
+            return -1;
+        }
+    }
+
+    if (tok != EOL)
+        return -1;
+
+    return fast_lex(lx);
+}
+
+fast_section* fast_parse_source(chunk *c) {
+    uint64_t n_max = 1;
+
+    for (char *p = c->text; p < c->text + c->length; p++) {
+        if (*p == '\n')
+            n_max++;
+    }
+
+    fast_section *fs = malloc(sizeof(*fs));
+    fs->lines = malloc(sizeof(*fs->lines) * n_max);
+    fs->insts = malloc(sizeof(*fs->insts) * n_max);
+    fs->n_lines = 0;
+
+    //every identifier is followed by at least one other character, so this is enough
+    char *arena = malloc(c->length + 1);
+    fs->arena = arena;
+
+    fast_lexer lx = { c->text, c->text + c->length, c->lineno, 1, NULL, 0, 0 };
+
+    fs->lineno = lx.lineno;
+
+    int tok = fast_lex(&lx);
+
+    if (tok == ENTER_SOURCE)
+        tok = fast_section_header(&lx, fs, &arena);
+    else
+        tok = -1;
+
+    while (tok == EOL)
+        tok = fast_lex(&lx);
+
+    //src_section needs at least one statement
+    if (tok == 0)
+        tok = -1;
+
+    while (tok > 0) {
+        tok = fast_statement(&lx, tok, &fs->lines[fs->n_lines], &fs->insts[fs->n_lines], &arena);
+        fs->n_lines++;
+    }
+
+    fs->end_lineno = lx.lineno;
+
+    if (tok < 0) {
+        free_fast_section(fs);
+        return NULL;
+    }
+
+    return fs;
+}
+
+void free_fast_section(fast_section *fs) {
+    free(fs->lines);
+    free(fs->insts);
+    free(fs->arena);
+    free(fs);
+}
+
+void commit_fast_section(fast_section *fs) {
+    yylineno = fs->lineno;
+
+    section_ident *sident = create_section_ident(fs->ident, fs->type, fs->base, fs->base_ident);
+
+    for (uint64_t i = 0; i < fs->n_lines; i++) {
+        fast_line *line = &fs->lines[i];
+
+        //bison has read the EOL already when an instruction ends in an operand or its name
+        yylineno = line->lineno + (line->type == FL_INST && line->in->type == NONE);
+
+        switch (line->type) {
+            case FL_INST:
+                //instructions that fail verification stay in the slab unused
+                place_inst(line->ident, line->in);
+                break;
+            case FL_LABEL:
+                register_label(line->ident, GLOBAL);
+                break;
+            case FL_LOCAL_LABEL:
+                register_label(line->ident, LOCAL);
+                break;
+            case FL_ABS_ADDRESS:
+                register_abs_address(line->value);
+                break;
+            case FL_REL_ADDRESS:
+                register_rel_address(line->value);
+                break;
+        }
+    }
+
+    yylineno = fs->end_lineno;
+
+    register_section(sident);
+}
+
+void scan_init(chunk_scanner *sc, char *buf) {
+    sc->buf = buf;
+    sc->p = buf;
+    sc->start = buf;
+    sc->lineno = 1;
+    sc->start_lineno = 1;
+    sc->in_comment = 0;
+    sc->type = CHUNK_TEXT;
+    sc->chunks = NULL;
+    sc->n_chunks = 0;
+}
+
+void scan_close_chunk(chunk_scanner *sc, char *p) {
+    //text ahead of the first header only matters if it produces tokens
+    int empty = (sc->type == CHUNK_TEXT);
+    for (char *q = sc->start; empty && q < p; q++) {
+        if (*q != '\n')
+            empty = 0;
+    }
+
+    if (empty)
+        return;
+
+    sc->chunks = realloc(sc->chunks, sizeof(*sc->chunks) * (sc->n_chunks + 1));
+
+    chunk *c = &sc->chunks[sc->n_chunks++];
+    c->type = sc->type;
+    c->text = sc->start;
+    c->length = p - sc->start;
+    c->lineno = sc->start_lineno;
+    c->fast = NULL;
+    c->done = 0;
+    c->skip = 0;
+}
+
+/*
+ * Scans buf up to end, appending every chunk that is known to be complete.
+ * Unless final is set, the last few bytes are left for the next call so a
+ * header cannot be split across two reads.
+ */
+int scan_step(chunk_scanner *sc, char *end, int final) {
+    char *p = sc->p;
+    char *limit = end;
+
+    if (!final)
+        limit = (end - p > 10) ? end - 10 : p;
+
+    while (p < limit) {
+        chunk_type next;
+        uint64_t n = 0;
+
+        if (*p == '\n') {
+            sc->in_comment = 0;
+            sc->lineno++;
+            p++;
+            continue;
+        } else if (sc->in_comment) {
+            p++;
+            continue;
+        } else if (*p == ';') {
+            sc->in_comment = 1;
+            p++;
+            continue;
+        } else if (*p == '#') {
+            return -1;
+        } else if (*p == 's' && (n = fast_keyword(p, end, "source:"))) {
+            next = CHUNK_SOURCE;
+        } else if (*p == 'm' && (n = fast_keyword(p, end, "microcode:"))) {
+            next = CHUNK_MICROCODE;
+        } else {
+            p++;
+            continue;
+        }
+
+        if (p != sc->buf && p[-1] != '\n' && p[-1] != ' ' && p[-1] != '\t')
+            return -1;
+
+        scan_close_chunk(sc, p);
+
+        sc->type = next;
+        sc->start = p;
+        sc->start_lineno = sc->lineno;
+        p += n;
+    }
+
+    sc->p = p;
+
+    if (final)
+        scan_close_chunk(sc, end);
+
+    return 0;
+}
+
+/*
+ * Headers are only recognised at the start of a line or after whitespace;
+ * any other occurrence, or any preprocessor directive, makes the split
+ * ambiguous and the whole input goes to yyparse.
+ */
+int64_t scan_chunks(char *buf, uint64_t len, chunk **chunks) {
+    chunk_scanner sc;
+
+    scan_init(&sc, buf);
+
+    if (scan_step(&sc, buf + len, 1)) {
+        free(sc.chunks);
+        return -1;
+    }
+
+    *chunks = sc.chunks;
+
+    return sc.n_chunks;
+}
+
+int parse_chunk(chunk *c) {
+    FILE *m = fmemopen(c->text, c->length, "r");
+
+    if (!m) {
+        perror("fmemopen");
+        return 1;
+    }
+
+    yyrestart(m);
+    yylineno = c->lineno;
+
+    int r = yyparse();
+
+    fclose(m);
+
+    return r;
+}
+
+char* read_input(FILE *f, uint64_t *len) {
+    uint64_t size = 1 << 16;
+    char *buf = malloc(size);
+    uint64_t n;
+
+    *len = 0;
+
+    while ((n = fread(buf + *len, 1, size - *len, f)) > 0) {
+        *len += n;
+        if (*len == size) {
+            size *= 2;
+            buf = realloc(buf, size);
+        }
+    }
+
+    //the fast lexer relies on numbers at the very end being terminated
+    buf[*len] = '\0';
+
+    return buf;
+}
+
+typedef struct {
+    chunk *chunks;
+    int64_t n_chunks;
+    int64_t next;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} parse_pool;
+
+void* parse_worker(void *arg) {
+    parse_pool *pool = arg;
+
+    while (1) {
+        int64_t i = __sync_fetch_and_add(&pool->next, 1);
+
+        if (i >= pool->n_chunks)
+            break;
+
+        chunk *c = &pool->chunks[i];
+        fast_section *fs = NULL;
+
+        if (c->type == CHUNK_SOURCE && !c->skip)
+            fs = fast_parse_source(c);
+
+        pthread_mutex_lock(&pool->lock);
+        c->fast = fs;
+        c->done = 1;
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return NULL;
+}
+
+uint64_t get_jobs(uint64_t jobs) {
+    if (jobs == 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = (n > 0) ? n : 1;
+    }
+
+    return jobs;
+}
+
+//header of a source chunk only; src_section_ident cannot span lines. The names stay in fs->arena
+int chunk_header(chunk *c, fast_section *fs) {
+    char *eol = memchr(c->text, '\n', c->length);
+    uint64_t len = eol ? (uint64_t)(eol - c->text) : c->length;
+    char *arena = malloc(len + 1);
+
+    fs->arena = arena;
+
+    fast_lexer lx = { c->text, c->text + len, c->lineno, 1, NULL, 0, 0 };
+
+    if (fast_lex(&lx) != ENTER_SOURCE || fast_section_header(&lx, fs, &arena) < 0)
+        return -1;
+
+    return 0;
+}
+
+void free_chunk_headers(fast_section *headers, int64_t n_chunks) {
+    for (int64_t i = 0; i < n_chunks; i++)
+        free(headers[i].arena);
+
+    free(headers);
+}
+
+/*
+ * Marks every source chunk that is neither a section called only nor a
+ * base (through REL_AUTO or REL_IDENT placement) of one that is needed.
+ * Returns -1 if that cannot be decided from the headers alone.
+ */
+int skip_unneeded_chunks(chunk *chunks, int64_t n_chunks, char *only) {
+    //automatic names depend on how many sections precede them
+    if (strncmp(only, "*auto-", 6) == 0)
+        return -1;
+
+    fast_section *headers = calloc(n_chunks + 1, sizeof(*headers));
+    int *needed = malloc(sizeof(*needed) * n_chunks);
+
+    for (int64_t i = 0; i < n_chunks; i++) {
+        needed[i] = 1;
+
+        if (chunks[i].type != CHUNK_SOURCE)
+            continue;
+
+        if (chunk_header(&chunks[i], &headers[i])) {
+            free_chunk_headers(headers, i + 1);
+            free(needed);
+            return -1;
+        }
+
+        needed[i] = headers[i].ident && strcmp(headers[i].ident, only) == 0;
+    }
+
+    //bases always come earlier in the file, so one backwards pass settles everything
+    for (int64_t i = n_chunks - 1; i >= 0; i--) {
+        if (chunks[i].type != CHUNK_SOURCE || !needed[i] || headers[i].type == ABS)
+            continue;
+
+        for (int64_t j = i - 1; j >= 0; j--) {
+            if (chunks[j].type != CHUNK_SOURCE)
+                continue;
+
+            if (headers[i].type == REL_AUTO || (headers[j].ident && strcmp(headers[j].ident, headers[i].base_ident) == 0)) {
+                needed[j] = 1;
+                break;
+            }
+        }
+    }
+
+    for (int64_t i = 0; i < n_chunks; i++)
+        chunks[i].skip = !needed[i];
+
+    free_chunk_headers(headers, n_chunks);
+    free(needed);
+
+    return 0;
+}
+
+int parse_input(FILE *f, int fast, uint64_t jobs, char *only) {
+    if (!fast)
+        return yyparse();
+
+    uint64_t len;
+    char *buf = read_input(f ? f : stdin, &len);
+
+    chunk *chunks = NULL;
+    int64_t n_chunks = scan_chunks(buf, len, &chunks);
+
+    if (n_chunks < 0) {
+        chunk whole = { CHUNK_TEXT, buf, len, 1, NULL, 1, 0 };
+        return parse_chunk(&whole);
+    }
+
+    if (only)
+        skip_unneeded_chunks(chunks, n_chunks, only);
+
+    jobs = get_jobs(jobs);
+
+    /*
+     * Source chunks only need the text to parse; everything that depends on
+     * earlier chunks (definitions, section bases, labels) happens when they
+     * are committed, which is done here in file order as workers finish.
+     */
+    parse_pool pool = { chunks, n_chunks, 0 };
+    pthread_t *workers = NULL;
+    uint64_t n_workers = 0;
+
+    if (jobs > 1) {
+        pthread_mutex_init(&pool.lock, NULL);
+        pthread_cond_init(&pool.cond, NULL);
+
+        workers = malloc(sizeof(*workers) * jobs);
+
+        for (; n_workers < jobs; n_workers++) {
+            if (pthread_create(&workers[n_workers], NULL, parse_worker, &pool))
+                break;
+        }
+    }
+
+    if (n_workers == 0) {
+        for (int64_t i = 0; i < n_chunks; i++) {
+            if (chunks[i].type == CHUNK_SOURCE && !chunks[i].skip)
+                chunks[i].fast = fast_parse_source(&chunks[i]);
+            chunks[i].done = 1;
+        }
+    }
+
+    int r = 0;
+
+    for (int64_t i = 0; i < n_chunks && !r; i++) {
+        if (n_workers) {
+            pthread_mutex_lock(&pool.lock);
+            while (!chunks[i].done)
+                pthread_cond_wait(&pool.cond, &pool.lock);
+            pthread_mutex_unlock(&pool.lock);
+        }
+
+        if (chunks[i].skip) {
+            continue;
+        } else if (chunks[i].fast) {
+            commit_fast_section(chunks[i].fast);
+        } else if (parse_chunk(&chunks[i])) {
+            r = 1;
+        }
+    }
+
+    if (n_workers) {
+        //stop handing out work if parsing failed early
+        __sync_fetch_and_add(&pool.next, n_chunks);
+
+        for (uint64_t i = 0; i < n_workers; i++)
+            pthread_join(workers[i], NULL);
+
+        free(workers);
+        pthread_mutex_destroy(&pool.lock);
+        pthread_cond_destroy(&pool.cond);
+    }
+
+    return r;
+}
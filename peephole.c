@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "kasm.h"
+
+/*
+ * Peephole optimisation over each section's instructions. The patterns
+ * come from the definitions' tags:
+ *
+ *   a move (sim=mov or the move tag) of a register to itself is dropped
+ *   a jump (sim=jmp, jz, jnz or the jump tag) to the next address is
+ *     dropped; other branches may do more than branch, so they stay
+ *   a repeat of an idempotent instruction is dropped: tagged idempotent,
+ *     or computing a register from other registers by its sim tag
+ *   mov a, b followed by mov b, a loses the second move
+ *   X followed by Y with the same operands is dropped entirely when X is
+ *     tagged cancels=Y, as for increment and decrement
+ *
+ * Pairs never span a label, an address gap or control flow, since
+ * something else could run in between. Removed words close up and labels
+ * follow their instructions; passes repeat until nothing changes.
+ */
+
+peep_def *peep_defs = NULL;
+
+uint64_t peep_removed[PEEP_PATTERNS];
+char *peep_names[PEEP_PATTERNS] = {
+    "self-moves", "jumps to next", "repeats", "move pairs", "cancelled pairs"
+};
+
+void build_peep_defs() {
+    idef **table;
+    uint64_t n_idefs = get_definitions(&table);
+
+    peep_defs = calloc(n_idefs + 1, sizeof(*peep_defs));
+
+    for (uint64_t i = 0; i < n_idefs; i++) {
+        peep_def *d = &peep_defs[i];
+        char *other = NULL;
+
+        d->flow = inst_flow(table[i]);
+        d->kind = has_tag(table[i], "sim", NULL, NULL) ? (int64_t)sim_kind_of(table[i], idef_get_info(table[i])->n_operands) : -1;
+        d->move = d->kind == SIM_MOV || has_tag(table[i], "move", NULL, NULL);
+        d->jump = d->kind == SIM_JMP || d->kind == SIM_JZ || d->kind == SIM_JNZ
+            || (d->kind < 0 && has_tag(table[i], "jump", NULL, NULL));
+        d->idempotent = has_tag(table[i], "idempotent", NULL, NULL);
+        d->cancels = NULL;
+
+        if (has_tag(table[i], "cancels", NULL, &other) && other) {
+            d->cancels = idef_lookup(other);
+
+            if (!d->cancels) {
+                fprintf(stderr, "Warning: cancels=%s on %s names no instruction, ignoring\n", other, table[i]->ident);
+                warn();
+            }
+        }
+    }
+}
+
+int is_register(operand *o) {
+    return o && !o->offset1;
+}
+
+int same_operand(operand *a, operand *b) {
+    if (!a || !b)
+        return a == b;
+
+    return a->base == b->base && a->offset1 == b->offset1 && a->offset2 == b->offset2;
+}
+
+int same_operands(inst *a, inst *b) {
+    if (a->type != b->type || a->immediate != b->immediate)
+        return 0;
+
+    return same_operand(a->oper1, b->oper1) && same_operand(a->oper2, b->oper2) && same_operand(a->oper3, b->oper3);
+}
+
+//the result depends only on registers the instruction does not write
+int is_idempotent(inst *in) {
+    peep_def *d = &peep_defs[idef_index(in->def)];
+
+    if (d->idempotent)
+        return 1;
+
+    if (d->kind < SIM_MOV || d->kind > SIM_LDI || !is_register(in->oper1))
+        return 0;
+
+    operand *sources[2] = { in->oper2, in->oper3 };
+
+    for (int k = 0; k < 2; k++) {
+        if (sources[k] && (!is_register(sources[k]) || sources[k]->base == in->oper1->base))
+            return 0;
+    }
+
+    return 1;
+}
+
+int is_noop(inst *in) {
+    peep_def *d = &peep_defs[idef_index(in->def)];
+
+    if (d->move && is_register(in->oper1) && same_operand(in->oper1, in->oper2)) {
+        peep_removed[PEEP_SELF_MOVE]++;
+        return 1;
+    }
+
+    if (d->jump && in->immediate == in->address + 1) {
+        peep_removed[PEEP_JUMP_NEXT]++;
+        return 1;
+    }
+
+    return 0;
+}
+
+//pattern for the pair, or -1
+int peep_pair(inst *a, inst *b) {
+    peep_def *da = &peep_defs[idef_index(a->def)];
+    peep_def *db = &peep_defs[idef_index(b->def)];
+
+    if (a->def == b->def && same_operands(a, b) && is_idempotent(b))
+        return PEEP_REPEAT;
+
+    if (da->move && db->move && is_register(a->oper1) && is_register(a->oper2) && is_register(b->oper1) && is_register(b->oper2)
+        && a->oper1->base == b->oper2->base && a->oper2->base == b->oper1->base)
+        return PEEP_MOVE_PAIR;
+
+    if (da->cancels == b->def && same_operands(a, b))
+        return PEEP_CANCEL;
+
+    return -1;
+}
+
+//one sweep; returns the number of words removed
+uint64_t peephole_sweep(section *s) {
+    uint8_t *label_at = calloc(s->n_insts + 1, 1);
+    uint8_t *removed = calloc(s->n_insts + 1, 1);
+    uint8_t *barrier_before = calloc(s->n_insts + 1, 1);
+    uint64_t *kept = malloc(sizeof(*kept) * (s->n_insts + 1));
+    uint64_t n_kept = 0, n_removed = 0, k = 0;
+
+    for (uint64_t j = 0; j < s->n_labels; j++) {
+        for (label *l = s->label_table[j]; l; l = l->child) {
+            while (k < s->n_insts && s->inst_table[k]->address < l->address)
+                k++;
+            label_at[k] = 1;
+        }
+    }
+
+    //set while something may run between the last kept instruction and the next
+    int barrier = 1;
+
+    for (k = 0; k < s->n_insts; k++) {
+        inst *in = s->inst_table[k];
+
+        if (label_at[k] || (k > 0 && in->address != s->inst_table[k - 1]->address + 1))
+            barrier = 1;
+
+        if (is_noop(in)) {
+            removed[k] = 1;
+            n_removed++;
+            continue;
+        }
+
+        if (!barrier && n_kept) {
+            uint64_t p = kept[n_kept - 1];
+            int pattern = peep_pair(s->inst_table[p], in);
+
+            if (pattern == PEEP_CANCEL) {
+                peep_removed[pattern] += 2;
+                removed[p] = removed[k] = 1;
+                n_removed += 2;
+                barrier = barrier_before[p];
+                n_kept--;
+                continue;
+            } else if (pattern >= 0) {
+                peep_removed[pattern]++;
+                removed[k] = 1;
+                n_removed++;
+                continue;
+            }
+        }
+
+        barrier_before[k] = barrier;
+        kept[n_kept++] = k;
+        barrier = peep_defs[idef_index(in->def)].flow != FLOW_NEXT;
+    }
+
+    if (n_removed) {
+        inst **table = malloc(sizeof(*table) * (n_kept + 1));
+        uint64_t *address = malloc(sizeof(*address) * (n_kept + 1));
+        uint64_t *slot_address = malloc(sizeof(*slot_address) * (s->n_insts + 1));
+        uint64_t gone = 0, n = 0;
+
+        //everything after a removed word moves down
+        for (k = 0; k < s->n_insts; k++) {
+            slot_address[k] = s->inst_table[k]->address - gone;
+
+            if (removed[k]) {
+                gone++;
+            } else {
+                address[n] = slot_address[k];
+                table[n++] = s->inst_table[k];
+            }
+        }
+        slot_address[s->n_insts] = s->size - gone;
+
+        relayout_section(s, table, address, n, slot_address);
+        resolve_labels(s, 0);
+
+        free(address);
+        free(slot_address);
+    }
+
+    free(label_at);
+    free(removed);
+    free(barrier_before);
+    free(kept);
+
+    return n_removed;
+}
+
+void peephole_program() {
+    build_peep_defs();
+
+    section **sections;
+    uint64_t n_sections = get_sections(&sections);
+    uint64_t before = 0, after = 0;
+
+    for (uint64_t s = 0; s < n_sections; s++) {
+        before += sections[s]->n_insts;
+
+        if (section_has_fixed_jumps(sections[s])) {
+            fprintf(stderr, "Warning: section %s jumps to numeric addresses, not optimising it\n", sections[s]->ident);
+            warn();
+        } else {
+            while (peephole_sweep(sections[s]))
+                ;
+        }
+
+        after += sections[s]->n_insts;
+    }
+
+    relayout_sections();
+
+    fprintf(stderr, "(peephole: %lu -> %lu instructions;", before, after);
+    for (int p = 0; p < PEEP_PATTERNS; p++)
+        fprintf(stderr, " %lu %s%s", peep_removed[p], peep_names[p], p + 1 < PEEP_PATTERNS ? "," : ")\n");
+
+    free(peep_defs);
+}
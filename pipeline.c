@@ -0,0 +1,303 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+
+#include "kasm.h"
+
+/*
+ * Pipelined mode: a reader thread pulls the input in blocks, the main
+ * thread scans and parses each chunk as soon as it has been read in full,
+ * an encoder thread encodes every section once register_section has
+ * resolved it, and a writer thread drains the formatted output. Passes
+ * that rewrite the code run after parsing, so with any of them the
+ * encoder is left out and words are encoded when they are emitted.
+ */
+
+#define PIPE_BLOCK (1 << 20)
+#define RING_SIZE (256)
+
+//single producer, single consumer; NULL marks the end of the stream
+typedef struct {
+    void *slots[RING_SIZE];
+    uint64_t head;
+    uint64_t tail;
+} ring;
+
+void ring_push(ring *r, void *p) {
+    uint64_t head = r->head;
+
+    while (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == RING_SIZE)
+        sched_yield();
+
+    r->slots[head & (RING_SIZE - 1)] = p;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void* ring_pop(ring *r) {
+    uint64_t tail = r->tail;
+
+    while (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail)
+        sched_yield();
+
+    void *p = r->slots[tail & (RING_SIZE - 1)];
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return p;
+}
+
+typedef struct {
+    FILE *f;
+    char *buf;
+    uint64_t size;
+    uint64_t avail;
+    int done;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} reader_state;
+
+void* reader_thread(void *arg) {
+    reader_state *rd = arg;
+    uint64_t len = 0;
+
+    while (len < rd->size) {
+        uint64_t want = rd->size - len;
+
+        if (want > PIPE_BLOCK)
+            want = PIPE_BLOCK;
+
+        uint64_t n = fread(rd->buf + len, 1, want, rd->f);
+
+        if (n == 0)
+            break;
+
+        len += n;
+
+        pthread_mutex_lock(&rd->lock);
+        rd->avail = len;
+        pthread_cond_broadcast(&rd->cond);
+        pthread_mutex_unlock(&rd->lock);
+    }
+
+    pthread_mutex_lock(&rd->lock);
+    rd->done = 1;
+    pthread_cond_broadcast(&rd->cond);
+    pthread_mutex_unlock(&rd->lock);
+
+    return NULL;
+}
+
+//instructions that would warn are left to the main thread, in order
+typedef struct {
+    ring r;
+    inst **deferred;
+    uint64_t n_deferred;
+} encoder_state;
+
+void* encoder_thread(void *arg) {
+    encoder_state *e = arg;
+    section *s;
+
+    while ((s = ring_pop(&e->r))) {
+        for (uint64_t j = 0; j < s->n_insts; j++) {
+            inst *in = s->inst_table[j];
+
+            if (!immediate_fits(in)) {
+                e->deferred = realloc(e->deferred, sizeof(*e->deferred) * (e->n_deferred + 1));
+                e->deferred[e->n_deferred++] = in;
+                continue;
+            }
+
+            in->word = encode_instruction(in);
+            in->encoded = 1;
+        }
+    }
+
+    return NULL;
+}
+
+//hands every section registered since the last call to the encoder
+void pipeline_feed(ring *r, uint64_t *n_fed) {
+    section **table;
+    uint64_t n = get_sections(&table);
+
+    for (; *n_fed < n; (*n_fed)++)
+        ring_push(r, table[*n_fed]);
+}
+
+int parse_input_pipelined(FILE *f, int encode, char *only) {
+    struct stat st;
+
+    //the buffer cannot move while chunks point into it, so the size must be known up front;
+    //picking the sections for only needs every header before anything is committed
+    if (!f || fstat(fileno(f), &st) || !S_ISREG(st.st_mode) || only)
+        return parse_input(f, 1, 1, only);
+
+    reader_state rd;
+
+    rd.f = f;
+    rd.size = st.st_size;
+    rd.buf = calloc(rd.size + 1, 1);
+    rd.avail = 0;
+    rd.done = 0;
+    pthread_mutex_init(&rd.lock, NULL);
+    pthread_cond_init(&rd.cond, NULL);
+
+    encoder_state *enc = calloc(1, sizeof(*enc));
+    uint64_t n_fed = 0;
+
+    pthread_t reader, encoder;
+
+    pthread_create(&reader, NULL, reader_thread, &rd);
+    if (encode)
+        pthread_create(&encoder, NULL, encoder_thread, enc);
+
+    chunk_scanner sc;
+    scan_init(&sc, rd.buf);
+
+    uint64_t scanned = 0, committed = 0;
+    int done = 0, joined = 0, r = 0;
+
+    while (!r) {
+        pthread_mutex_lock(&rd.lock);
+        while (rd.avail == scanned && !rd.done)
+            pthread_cond_wait(&rd.cond, &rd.lock);
+        scanned = rd.avail;
+        done = rd.done;
+        pthread_mutex_unlock(&rd.lock);
+
+        if (scan_step(&sc, rd.buf + scanned, done)) {
+            //everything from the first uncommitted chunk on goes to yyparse in one piece
+            pthread_join(reader, NULL);
+            joined = 1;
+
+            chunk rest = { CHUNK_TEXT, sc.start, 0, sc.start_lineno, NULL, 1, 0 };
+            if (committed < sc.n_chunks) {
+                rest.text = sc.chunks[committed].text;
+                rest.lineno = sc.chunks[committed].lineno;
+            }
+            rest.length = rd.buf + rd.avail - rest.text;
+
+            if (rest.length)
+                r = parse_chunk(&rest);
+            if (encode)
+                pipeline_feed(&enc->r, &n_fed);
+            break;
+        }
+
+        for (; committed < sc.n_chunks && !r; committed++) {
+            chunk *c = &sc.chunks[committed];
+
+            if (c->type == CHUNK_SOURCE)
+                c->fast = fast_parse_source(c);
+
+            if (c->fast)
+                commit_fast_section(c->fast);
+            else
+                r = parse_chunk(c);
+
+            if (encode)
+                pipeline_feed(&enc->r, &n_fed);
+        }
+
+        if (done)
+            break;
+    }
+
+    if (!joined)
+        pthread_join(reader, NULL);
+
+    if (encode) {
+        ring_push(&enc->r, NULL);
+        pthread_join(encoder, NULL);
+    }
+
+    for (uint64_t k = 0; k < enc->n_deferred; k++) {
+        inst *in = enc->deferred[k];
+
+        in->word = encode_instruction(in);
+        in->encoded = 1;
+    }
+
+    pthread_mutex_destroy(&rd.lock);
+    pthread_cond_destroy(&rd.cond);
+    free(enc->deferred);
+    free(enc);
+
+    return r;
+}
+
+typedef struct {
+    FILE *out;
+    ring r;
+    pthread_t thread;
+} writer_state;
+
+typedef struct {
+    uint64_t len;
+    char data[];
+} out_block;
+
+void* writer_thread(void *arg) {
+    writer_state *w = arg;
+    out_block *b;
+
+    while ((b = ring_pop(&w->r))) {
+        fwrite(b->data, 1, b->len, w->out);
+        free(b);
+    }
+
+    return NULL;
+}
+
+ssize_t writer_write(void *cookie, const char *buf, size_t size) {
+    writer_state *w = cookie;
+    out_block *b = malloc(sizeof(*b) + size);
+
+    b->len = size;
+    memcpy(b->data, buf, size);
+
+    ring_push(&w->r, b);
+
+    return size;
+}
+
+int writer_close(void *cookie) {
+    writer_state *w = cookie;
+
+    ring_push(&w->r, NULL);
+    pthread_join(w->thread, NULL);
+    fflush(w->out);
+    free(w);
+
+    return 0;
+}
+
+//output written to the returned stream is handed to a writer thread in PIPE_BLOCK pieces; fclose it to finish
+FILE* pipeline_writer_open(FILE *out) {
+    writer_state *w = calloc(1, sizeof(*w));
+
+    w->out = out;
+
+    if (pthread_create(&w->thread, NULL, writer_thread, w)) {
+        free(w);
+        return out;
+    }
+
+    cookie_io_functions_t io = { NULL, writer_write, NULL, writer_close };
+    FILE *f = fopencookie(w, "w", io);
+
+    if (!f) {
+        writer_close(w);
+        return out;
+    }
+
+    setvbuf(f, NULL, _IOFBF, PIPE_BLOCK);
+
+    return f;
+}
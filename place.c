@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "kasm.h"
+
+/*
+ * Profile-guided placement. A profile holds execution counts, one per
+ * line, in any of the forms
+ *
+ *   SECTION: LABEL: COUNT     as printed by --simulate
+ *   SECTION: COUNT
+ *   ADDRESS COUNT             a real address in the unplaced program
+ *
+ * and other lines are skipped. A section's heat is the sum of its counts.
+ *
+ * Only relocatable sections placed automatically, straight after the one
+ * before them, move: each run of them behind a head section is put in
+ * order of heat, hottest first, so the hot ones sit together behind the
+ * head. Absolute sections and those placed after a named section stay
+ * where they are, and so does any run another section is placed after.
+ * The gain is given as the spread of the hot code, from its lowest to its
+ * highest word, and the number of separate stretches it makes up.
+ */
+
+uint64_t *place_heat = NULL;
+
+int64_t place_section_at(section **sections, uint64_t n_sections, uint64_t address) {
+    for (uint64_t s = 0; s < n_sections; s++) {
+        if (address >= sections[s]->base && address < sections[s]->base + sections[s]->size)
+            return s;
+    }
+
+    return -1;
+}
+
+char* place_trim(char *p) {
+    while (isspace((unsigned char)*p))
+        p++;
+
+    char *end = p + strlen(p);
+    while (end > p && isspace((unsigned char)end[-1]))
+        *--end = '\0';
+
+    return p;
+}
+
+//counts that fall outside every section go to unmatched
+int read_profile(char *path, section **sections, uint64_t n_sections, uint64_t *unmatched) {
+    FILE *f = fopen(path, "r");
+
+    if (!f) {
+        perror(path);
+        return 1;
+    }
+
+    char line[1024];
+    *unmatched = 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        char *p = place_trim(line);
+        char *colon = strchr(p, ':');
+        char *end;
+        int64_t s;
+        uint64_t count;
+
+        if (colon) {
+            char *c = place_trim(strrchr(p, ':') + 1);
+
+            count = strtoull(c, &end, 0);
+            if (end == c || *end)
+                continue;
+
+            *colon = '\0';
+            section *sec = section_lookup(place_trim(p));
+            s = -1;
+            for (uint64_t k = 0; sec && k < n_sections; k++) {
+                if (sections[k] == sec)
+                    s = k;
+            }
+        } else {
+            uint64_t address = strtoull(p, &end, 0);
+
+            if (end == p || !isspace((unsigned char)*end))
+                continue;
+
+            char *q = place_trim(end);
+            count = strtoull(q, &end, 0);
+            if (end == q || *end)
+                continue;
+
+            s = place_section_at(sections, n_sections, address);
+        }
+
+        if (s < 0)
+            *unmatched += count;
+        else
+            place_heat[s] += count;
+    }
+
+    fclose(f);
+
+    return 0;
+}
+
+int place_span_cmp(const void *a, const void *b) {
+    const place_span *x = a;
+    const place_span *y = b;
+
+    return (x->base > y->base) - (x->base < y->base);
+}
+
+//extent of the hot sections and the number of stretches they form
+void place_spread(section **sections, uint64_t n_sections, uint64_t *spread, uint64_t *runs) {
+    place_span *spans = malloc(sizeof(*spans) * (n_sections + 1));
+    uint64_t n = 0;
+
+    for (uint64_t s = 0; s < n_sections; s++) {
+        if (!sections[s]->size)
+            continue;
+
+        spans[n].base = sections[s]->base;
+        spans[n].end = sections[s]->base + sections[s]->size;
+        spans[n++].hot = place_heat[s] > 0;
+    }
+
+    qsort(spans, n, sizeof(*spans), place_span_cmp);
+
+    uint64_t low = UINT64_MAX, high = 0, last_end = 0;
+    int in_run = 0;
+
+    //a cold section or a gap ends a stretch
+    *runs = 0;
+    for (uint64_t k = 0; k < n; k++) {
+        if (spans[k].hot) {
+            if (spans[k].base < low)
+                low = spans[k].base;
+            if (spans[k].end > high)
+                high = spans[k].end;
+            if (!in_run || spans[k].base > last_end)
+                (*runs)++;
+        }
+        in_run = spans[k].hot;
+        last_end = spans[k].end;
+    }
+
+    *spread = (high > low) ? high - low : 0;
+
+    free(spans);
+}
+
+//sections head+1 .. end-1 each follow the one before; returns how many moved
+uint64_t place_run(section **sections, uint64_t n_sections, uint64_t head, uint64_t end) {
+    for (uint64_t x = 0; x < n_sections; x++) {
+        int64_t from = sections[x]->base_from;
+
+        if ((x <= head || x >= end) && from > (int64_t)head && from < (int64_t)end) {
+            fprintf(stderr, "Warning: section %s is placed after %s, not reordering the sections behind %s\n",
+                    sections[x]->ident, sections[from]->ident, sections[head]->ident);
+            warn();
+            return 0;
+        }
+    }
+
+    uint64_t n = end - head - 1;
+    uint64_t *order = malloc(sizeof(*order) * (n + 1));
+
+    //stable, hottest first
+    for (uint64_t k = 0; k < n; k++) {
+        uint64_t j = k;
+
+        while (j > 0 && place_heat[order[j - 1]] < place_heat[head + 1 + k]) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = head + 1 + k;
+    }
+
+    uint64_t moved = 0;
+    for (uint64_t k = 0; k < n; k++) {
+        sections[order[k]]->base_from = k ? (int64_t)order[k - 1] : (int64_t)head;
+        moved += order[k] != head + 1 + k;
+    }
+
+    free(order);
+
+    return moved;
+}
+
+int place_sections(char *path) {
+    section **sections;
+    uint64_t n_sections = get_sections(&sections);
+    uint64_t unmatched;
+
+    place_heat = calloc(n_sections + 1, sizeof(*place_heat));
+
+    if (read_profile(path, sections, n_sections, &unmatched))
+        return 1;
+
+    uint64_t spread_before, runs_before, spread_after, runs_after;
+    place_spread(sections, n_sections, &spread_before, &runs_before);
+
+    uint64_t moved = 0;
+
+    for (uint64_t head = 0; head < n_sections;) {
+        uint64_t end = head + 1;
+
+        while (end < n_sections && sections[end]->type == REL_AUTO && sections[end]->base_from == (int64_t)end - 1)
+            end++;
+
+        if (end - head > 2)
+            moved += place_run(sections, n_sections, head, end);
+
+        head = end;
+    }
+
+    relayout_sections();
+
+    place_spread(sections, n_sections, &spread_after, &runs_after);
+
+    fprintf(stderr, "(placement: %lu sections moved; hot code spread over %lu words in %lu stretches, was %lu words in %lu",
+            moved, spread_after, runs_after, spread_before, runs_before);
+    if (unmatched)
+        fprintf(stderr, "; %lu counts outside any section", unmatched);
+    fprintf(stderr, ")\n");
+
+    free(place_heat);
+
+    return 0;
+}
@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "kasm.h"
+
+/*
+ * Relaxation of immediates too wide for their field. A short immediate
+ * over 7 bits whose instruction names a long form with long=NAME, and
+ * whose first two operands are the same, becomes NAME oper1, imm: a
+ * definition taking one operand and a 14-bit immediate.
+ *
+ * Anything still too wide, label targets included, is preceded by
+ * prefix words: instructions of the definition tagged prefix, each
+ * carrying the next 14 high bits, so that
+ *
+ *   value = ((p1 << 14 | p2 ...) << width) | field
+ *
+ * Labels land on the first prefix. Inserting words moves labels, which
+ * can push other targets out of range, so a section is relaid until no
+ * instruction needs more prefixes; prefixes are never taken away, which
+ * bounds the iteration. Prefix values are filled in from the final
+ * layout.
+ */
+
+idef *relax_prefix = NULL;
+idef **relax_long = NULL;
+operand relax_prefix_operand = { 0, 0, 0 };
+
+uint64_t relax_widened = 0;
+uint64_t relax_words = 0;
+uint64_t relax_passes = 0;
+
+void build_relax_defs() {
+    idef **table;
+    uint64_t n_idefs = get_definitions(&table);
+
+    relax_long = calloc(n_idefs + 1, sizeof(*relax_long));
+    relax_prefix = NULL;
+
+    for (uint64_t i = 0; i < n_idefs; i++) {
+        char *name = NULL;
+
+        if (has_tag(table[i], "prefix", NULL, NULL) && !relax_prefix) {
+            idef_info *info = idef_get_info(table[i]);
+
+            if (info->n_immediates != 2 || info->n_operands > 1) {
+                fprintf(stderr, "Warning: prefix %s needs a long immediate and at most one operand, ignoring\n", table[i]->ident);
+                warn();
+            } else {
+                relax_prefix = table[i];
+            }
+        }
+
+        if (has_tag(table[i], "long", NULL, &name) && name) {
+            idef *def = idef_lookup(name);
+
+            if (!def) {
+                fprintf(stderr, "Warning: long=%s on %s names no instruction, ignoring\n", name, table[i]->ident);
+                warn();
+            } else if (idef_get_info(def)->n_immediates != 2 || idef_get_info(def)->n_operands != 1) {
+                fprintf(stderr, "Warning: long form %s of %s needs one operand and a long immediate, ignoring\n", name, table[i]->ident);
+                warn();
+            } else {
+                relax_long[i] = def;
+            }
+        }
+    }
+}
+
+uint64_t relax_width(inst *in) {
+    return in->type == SINGLE ? 7 : 14;
+}
+
+uint64_t relax_prefixes_needed(inst *in) {
+    uint64_t n = 0;
+
+    if (in->type == NONE)
+        return 0;
+
+    for (uint64_t v = in->immediate >> relax_width(in); v; v >>= 14)
+        n++;
+
+    return n;
+}
+
+int relax_widen(inst *in) {
+    idef *def = relax_long[idef_index(in->def)];
+
+    if (!def || in->type != SINGLE || in->immediate < (1 << 7) || !same_operand(in->oper1, in->oper2))
+        return 0;
+
+    in->def = def;
+    in->type = DOUBLE;
+    in->oper2 = NULL;
+    in->encoded = 0;
+
+    return 1;
+}
+
+//returns the number of prefix words added
+uint64_t relax_section(section *s) {
+    uint64_t added = 0;
+    uint64_t *extra = NULL;
+
+    for (;;) {
+        uint64_t grow = 0;
+
+        extra = realloc(extra, sizeof(*extra) * (s->n_insts + 1));
+        memset(extra, 0, sizeof(*extra) * (s->n_insts + 1));
+
+        //new prefixes go in front of the existing ones
+        for (uint64_t k = 0; k < s->n_insts; k++) {
+            inst *in = s->inst_table[k];
+            uint64_t need = relax_prefixes_needed(in);
+
+            if (need > in->prefixes) {
+                extra[k - in->prefixes] = need - in->prefixes;
+                grow += need - in->prefixes;
+            }
+        }
+
+        if (!grow)
+            break;
+
+        if (!added && (!relax_prefix || section_has_fixed_jumps(s))) {
+            if (relax_prefix)
+                fprintf(stderr, "Warning: section %s jumps to numeric addresses, not adding prefixes\n", s->ident);
+            else
+                fprintf(stderr, "Warning: section %s has immediates out of range and no prefix instruction is defined\n", s->ident);
+            warn();
+            break;
+        }
+
+        relax_passes++;
+
+        inst **table = malloc(sizeof(*table) * (s->n_insts + grow + 1));
+        uint64_t *address = malloc(sizeof(*address) * (s->n_insts + grow + 1));
+        uint64_t *slot_address = malloc(sizeof(*slot_address) * (s->n_insts + 1));
+        uint64_t shift = 0, n = 0;
+
+        for (uint64_t k = 0; k < s->n_insts; k++) {
+            inst *in = s->inst_table[k];
+
+            slot_address[k] = in->address + shift;
+
+            for (uint64_t p = 0; p < extra[k]; p++) {
+                inst *prefix = calloc(1, sizeof(*prefix));
+
+                prefix->def = relax_prefix;
+                prefix->type = DOUBLE;
+                prefix->oper1 = idef_get_info(relax_prefix)->n_operands ? &relax_prefix_operand : NULL;
+                address[n] = slot_address[k] + p;
+                table[n++] = prefix;
+            }
+
+            shift += extra[k];
+
+            uint64_t need = relax_prefixes_needed(in);
+            if (need > in->prefixes)
+                in->prefixes = need;
+
+            address[n] = in->address + shift;
+            table[n++] = in;
+        }
+        slot_address[s->n_insts] = s->size + shift;
+
+        relayout_section(s, table, address, n, slot_address);
+        resolve_labels(s, 0);
+
+        free(address);
+        free(slot_address);
+        added += grow;
+    }
+
+    free(extra);
+
+    //prefix values from the final immediates, nearest prefix lowest
+    for (uint64_t k = 0; k < s->n_insts; k++) {
+        inst *in = s->inst_table[k];
+        uint64_t v = in->immediate >> relax_width(in);
+
+        for (uint64_t p = 1; p <= in->prefixes && p <= k; p++) {
+            s->inst_table[k - p]->immediate = v & 0x3FFF;
+            v >>= 14;
+        }
+    }
+
+    return added;
+}
+
+void relax_program() {
+    build_relax_defs();
+
+    section **sections;
+    uint64_t n_sections = get_sections(&sections);
+
+    for (uint64_t s = 0; s < n_sections; s++) {
+        for (uint64_t k = 0; k < sections[s]->n_insts; k++)
+            relax_widened += relax_widen(sections[s]->inst_table[k]);
+
+        relax_words += relax_section(sections[s]);
+    }
+
+    relayout_sections();
+
+    fprintf(stderr, "(relax: %lu widened to long forms, %lu prefix words in %lu passes)\n", relax_widened, relax_words, relax_passes);
+
+    free(relax_long);
+}
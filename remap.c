@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+#include "kasm.h"
+
+/*
+ * Opcode reassignment from usage statistics. Counts come from the program
+ * being assembled and from images of other programs built against the
+ * same microcode. Opcodes are handed out hottest first; each takes the
+ * free number closest in Hamming distance to the opcodes it most often
+ * follows or precedes, so the opcode field toggles as little as possible,
+ * with ties going to numbers with fewer set bits. The microcode ROM is
+ * reordered to match.
+ */
+
+opcode_usage* usage_create() {
+    idef **table;
+    uint64_t n = get_definitions(&table);
+
+    opcode_usage *u = calloc(1, sizeof(*u));
+    u->n = n;
+    u->count = calloc(n + 1, sizeof(*u->count));
+    u->trans = calloc(n * n + 1, sizeof(*u->trans));
+
+    return u;
+}
+
+void usage_free(opcode_usage *u) {
+    free(u->count);
+    free(u->trans);
+    free(u);
+}
+
+void usage_count(opcode_usage *u, int64_t prev, uint64_t i) {
+    u->count[i]++;
+    if (prev >= 0)
+        u->trans[prev * u->n + i]++;
+}
+
+//consecutive instructions within each section of the current program
+void usage_add_program(opcode_usage *u) {
+    section **table;
+    uint64_t n_sections = get_sections(&table);
+
+    for (uint64_t s = 0; s < n_sections; s++) {
+        int64_t prev = -1;
+
+        for (uint64_t j = 0; j < table[s]->n_insts; j++) {
+            uint64_t i = idef_index(table[s]->inst_table[j]->def);
+
+            usage_count(u, prev, i);
+            prev = i;
+        }
+    }
+}
+
+//an image as written by --format=bin or sparse; gaps, which only a sparse image records, break the sequence
+int usage_add_image(opcode_usage *u, char *path) {
+    image *img = image_read(path);
+
+    if (!img)
+        return 1;
+
+    idef **table;
+    uint64_t n_idefs = get_definitions(&table);
+
+    int64_t by_value[1 << INST_OPCODE_BITS];
+    for (uint64_t v = 0; v < (1 << INST_OPCODE_BITS); v++)
+        by_value[v] = -1;
+    for (uint64_t i = 0; i < n_idefs; i++)
+        by_value[table[i]->value & ((1 << INST_OPCODE_BITS) - 1)] = i;
+
+    int64_t prev = -1;
+
+    for (uint64_t a = image_next(img, 0); a < img->size; a++) {
+        if (!image_is_set(img, a)) {
+            prev = -1;
+            a = image_next(img, a) - 1;
+            continue;
+        }
+
+        uint32_t w = le32toh(img->words[a]);
+        int64_t i = by_value[(w >> 21) & ((1 << INST_OPCODE_BITS) - 1)];
+
+        if (i < 0) {
+            prev = -1;
+            continue;
+        }
+
+        usage_count(u, prev, i);
+        prev = i;
+    }
+
+    image_free(img);
+
+    return 0;
+}
+
+//weighted bit flips on the opcode field between consecutive instructions
+uint64_t usage_switching(opcode_usage *u, uint64_t *code) {
+    uint64_t flips = 0;
+
+    for (uint64_t a = 0; a < u->n; a++) {
+        for (uint64_t b = 0; b < u->n; b++) {
+            if (u->trans[a * u->n + b])
+                flips += u->trans[a * u->n + b] * __builtin_popcountl(code[a] ^ code[b]);
+        }
+    }
+
+    return flips;
+}
+
+//new index for every definition, a permutation of 0..n-1
+uint64_t* remap_assign(opcode_usage *u) {
+    uint64_t n = u->n;
+    uint64_t *order = malloc(sizeof(*order) * (n + 1));
+    uint64_t *code = malloc(sizeof(*code) * (n + 1));
+    int *used = calloc(n + 1, sizeof(*used));
+    int *placed = calloc(n + 1, sizeof(*placed));
+    uint64_t *nb = malloc(sizeof(*nb) * (n + 1));
+    uint64_t *nbw = malloc(sizeof(*nbw) * (n + 1));
+
+    //hottest first, registration order among equals
+    for (uint64_t i = 0; i < n; i++) {
+        uint64_t j = i;
+        for (; j > 0 && u->count[order[j - 1]] < u->count[i]; j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+
+    uint64_t next_free = 0;
+
+    for (uint64_t k = 0; k < n; k++) {
+        uint64_t i = order[k];
+
+        //unused instructions keep their relative order in the remaining numbers
+        if (u->count[i] == 0) {
+            while (used[next_free])
+                next_free++;
+            code[i] = next_free;
+            used[next_free] = 1;
+            placed[i] = 1;
+            continue;
+        }
+
+        uint64_t n_nb = 0;
+        for (uint64_t j = 0; j < n; j++) {
+            uint64_t w = u->trans[i * n + j] + u->trans[j * n + i];
+            if (placed[j] && w) {
+                nb[n_nb] = j;
+                nbw[n_nb++] = w;
+            }
+        }
+
+        int64_t best = -1;
+        uint64_t best_cost = 0;
+
+        for (uint64_t c = 0; c < n; c++) {
+            if (used[c])
+                continue;
+
+            uint64_t cost = 0;
+            for (uint64_t m = 0; m < n_nb; m++)
+                cost += nbw[m] * __builtin_popcountl(c ^ code[nb[m]]);
+
+            if (best < 0 || cost < best_cost || (cost == best_cost && __builtin_popcountl(c) < __builtin_popcountl(best))) {
+                best = c;
+                best_cost = cost;
+            }
+        }
+
+        code[i] = best;
+        used[best] = 1;
+        placed[i] = 1;
+    }
+
+    free(order);
+    free(used);
+    free(placed);
+    free(nb);
+    free(nbw);
+
+    return code;
+}
+
+void remap_opcodes(opcode_usage *u) {
+    idef **table;
+    uint64_t n = get_definitions(&table);
+
+    uint64_t *identity = malloc(sizeof(*identity) * (n + 1));
+    for (uint64_t i = 0; i < n; i++)
+        identity[i] = i;
+
+    uint64_t *code = remap_assign(u);
+
+    printf("opcode remap: %lu -> %lu opcode bit flips between consecutive instructions\n",
+           usage_switching(u, identity), usage_switching(u, code));
+
+    for (uint64_t i = 0; i < n; i++)
+        printf("  %s: %lu -> %lu (%lu uses)\n", table[i]->ident, i, code[i], u->count[i]);
+
+    reorder_definitions(code);
+
+    //words encoded ahead of time, as in --pipeline, carry the old opcodes
+    section **sections;
+    uint64_t n_sections = get_sections(&sections);
+
+    for (uint64_t s = 0; s < n_sections; s++) {
+        for (uint64_t j = 0; j < sections[s]->n_insts; j++)
+            sections[s]->inst_table[j]->encoded = 0;
+    }
+
+    free(identity);
+    free(code);
+}
@@ -0,0 +1,472 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "kasm.h"
+
+/*
+ * Instruction scheduling. One instruction issues per cycle. A result is
+ * ready latency=N cycles after its instruction issues (1 by default, no
+ * stall), and an instruction tagged unit=NAME keeps that unit busy for
+ * busy=N cycles. Registers are read and written as the sim tags say;
+ * without one, the first operand counts as both. Memory operands read
+ * their base register and order against every other memory access that
+ * might conflict.
+ *
+ * Blocks end at labels, address gaps and control flow, which stays last.
+ * Within a block the instructions are list-scheduled by critical path,
+ * and a filler (a definition tagged filler, else nop) goes wherever no
+ * instruction can issue. Pending results carry over into the block that
+ * follows by falling through; jumps into a label are not followed. The
+ * original order is kept whenever the schedule does not beat it.
+ */
+
+sched_def *sched_defs = NULL;
+idef *sched_filler = NULL;
+uint64_t sched_max_delay = 1;
+
+char *sched_unit_names[SCHED_UNITS];
+uint64_t n_sched_units = 0;
+
+uint64_t sched_stalls_before = 0;
+uint64_t sched_stalls_after = 0;
+uint64_t sched_fillers = 0;
+uint64_t sched_moved = 0;
+
+uint64_t sched_numeric_tag(idef *def, char *ident, uint64_t fallback) {
+    uint64_t v = 0;
+
+    //numeric tag values are stored plus one
+    if (!has_tag(def, ident, &v, NULL) || v == 0)
+        return fallback;
+
+    return v - 1;
+}
+
+int64_t sched_unit(char *name) {
+    for (uint64_t u = 0; u < n_sched_units; u++) {
+        if (strcmp(sched_unit_names[u], name) == 0)
+            return u;
+    }
+
+    if (n_sched_units == SCHED_UNITS) {
+        fprintf(stderr, "Warning: more than %d units, ignoring unit %s\n", SCHED_UNITS, name);
+        warn();
+        return -1;
+    }
+
+    sched_unit_names[n_sched_units] = name;
+    return n_sched_units++;
+}
+
+void build_sched_defs() {
+    idef **table;
+    uint64_t n_idefs = get_definitions(&table);
+
+    sched_defs = calloc(n_idefs + 1, sizeof(*sched_defs));
+
+    for (uint64_t i = 0; i < n_idefs; i++) {
+        sched_def *d = &sched_defs[i];
+        idef_info *info = idef_get_info(table[i]);
+        char *unit = NULL;
+
+        d->latency = sched_numeric_tag(table[i], "latency", 1);
+        d->busy = sched_numeric_tag(table[i], "busy", 1);
+        d->unit = (has_tag(table[i], "unit", NULL, &unit) && unit) ? sched_unit(unit) : -1;
+        d->flow = inst_flow(table[i]);
+
+        if (d->latency > sched_max_delay)
+            sched_max_delay = d->latency;
+        if (d->busy > sched_max_delay)
+            sched_max_delay = d->busy;
+
+        if (!has_tag(table[i], "sim", NULL, NULL)) {
+            d->reads_first = 1;
+            d->writes_first = 1;
+        } else {
+            sim_kind k = sim_kind_of(table[i], info->n_operands);
+
+            d->writes_first = (k >= SIM_MOV && k <= SIM_LDI);
+            d->reads_first = (k == SIM_JZ || k == SIM_JNZ);
+        }
+
+        if (!sched_filler && has_tag(table[i], "filler", NULL, NULL))
+            sched_filler = table[i];
+    }
+
+    if (!sched_filler)
+        sched_filler = idef_lookup("nop");
+
+    if (sched_filler && (idef_get_info(sched_filler)->n_operands || idef_get_info(sched_filler)->n_immediates))
+        sched_filler = NULL;
+}
+
+void sched_operand(sched_effect *e, operand *o, int reads, int writes) {
+    if (!o)
+        return;
+
+    if (!o->offset1) {
+        if (reads)
+            e->reads |= 1 << o->base;
+        if (writes)
+            e->writes |= 1 << o->base;
+        return;
+    }
+
+    //the address comes from the base register, rB[x][y] also loads a pointer
+    e->reads |= 1 << o->base;
+    e->mem_read |= reads || o->offset2;
+    e->mem_write |= writes;
+}
+
+sched_effect sched_effect_of(inst *in) {
+    sched_def *d = &sched_defs[idef_index(in->def)];
+    sched_effect e = { 0, 0, 0, 0 };
+
+    sched_operand(&e, in->oper1, d->reads_first, d->writes_first);
+    sched_operand(&e, in->oper2, 1, 0);
+    sched_operand(&e, in->oper3, 1, 0);
+
+    return e;
+}
+
+/*
+ * Issues the block's instructions in the given order, as early as their
+ * dependences, units and the carried state allow, and returns the cycles
+ * it takes. With out set, the instructions and fillers are appended there
+ * and the carried state is advanced past the block.
+ */
+uint64_t sched_issue(sched_block *b, uint64_t *order, inst ***out, uint64_t *n_out, uint64_t *stalls) {
+    uint64_t issue[SCHED_WINDOW];
+    uint64_t unit_free[SCHED_UNITS];
+    uint64_t reg_ready[16];
+    uint64_t t = 0;
+
+    memcpy(unit_free, b->unit_free, sizeof(unit_free));
+    memcpy(reg_ready, b->reg_ready, sizeof(reg_ready));
+    *stalls = 0;
+
+    for (uint64_t p = 0; p < b->n; p++) {
+        uint64_t j = order[p];
+        sched_def *d = &sched_defs[idef_index(b->insts[j]->def)];
+        uint64_t at = t;
+
+        for (uint64_t i = 0; i < b->n; i++) {
+            if (b->dist[i][j] >= 0 && issue[i] + b->dist[i][j] > at)
+                at = issue[i] + b->dist[i][j];
+        }
+
+        for (uint64_t r = 0; r < 16; r++) {
+            if ((b->effect[j].reads >> r) & 1 && reg_ready[r] > at)
+                at = reg_ready[r];
+        }
+
+        if (d->unit >= 0 && unit_free[d->unit] > at)
+            at = unit_free[d->unit];
+
+        *stalls += at - t;
+
+        if (out) {
+            for (; t < at && sched_filler; t++) {
+                inst *f = calloc(1, sizeof(*f));
+                f->def = sched_filler;
+                f->type = NONE;
+                (*out)[(*n_out)++] = f;
+            }
+            (*out)[(*n_out)++] = b->insts[j];
+        }
+
+        issue[j] = at;
+        t = at + 1;
+
+        if (d->unit >= 0)
+            unit_free[d->unit] = at + d->busy;
+
+        for (uint64_t r = 0; r < 16; r++) {
+            if ((b->effect[j].writes >> r) & 1)
+                reg_ready[r] = at + d->latency;
+        }
+    }
+
+    if (out) {
+        //what is still pending when the next block starts
+        for (uint64_t u = 0; u < SCHED_UNITS; u++)
+            b->unit_free[u] = unit_free[u] > t ? unit_free[u] - t : 0;
+        for (uint64_t r = 0; r < 16; r++)
+            b->reg_ready[r] = reg_ready[r] > t ? reg_ready[r] - t : 0;
+    }
+
+    return t;
+}
+
+void sched_dependences(sched_block *b) {
+    for (uint64_t j = 0; j < b->n; j++) {
+        sched_def *dj = &sched_defs[idef_index(b->insts[j]->def)];
+        sched_effect *ej = &b->effect[j];
+
+        b->dist[j][j] = -1;
+
+        for (uint64_t i = 0; i < j; i++) {
+            sched_def *di = &sched_defs[idef_index(b->insts[i]->def)];
+            sched_effect *ei = &b->effect[i];
+            int64_t d = -1;
+
+            if (ei->writes & ej->reads)
+                d = di->latency;
+            if ((ei->reads & ej->writes) && d < 1)
+                d = 1;
+            //a later write must also land later
+            if (ei->writes & ej->writes) {
+                int64_t w = (int64_t)di->latency - (int64_t)dj->latency + 1;
+                if (w < 1)
+                    w = 1;
+                if (w > d)
+                    d = w;
+            }
+            if (ei->mem_write && ej->mem_read && (int64_t)di->latency > d)
+                d = di->latency;
+            if (((ei->mem_write && ej->mem_write) || (ei->mem_read && ej->mem_write)) && d < 1)
+                d = 1;
+            //control flow stays last
+            if (dj->flow != FLOW_NEXT && d < 1)
+                d = 1;
+
+            b->dist[i][j] = d;
+            b->dist[j][i] = -1;
+        }
+    }
+}
+
+//list scheduling by the longest latency path to the end of the block
+void sched_list(sched_block *b, uint64_t *order) {
+    uint64_t height[SCHED_WINDOW];
+    uint64_t earliest[SCHED_WINDOW];
+    int done[SCHED_WINDOW] = { 0 };
+    uint64_t unit_free[SCHED_UNITS];
+
+    memcpy(unit_free, b->unit_free, sizeof(unit_free));
+
+    for (uint64_t j = b->n; j > 0; j--) {
+        uint64_t i = j - 1;
+
+        height[i] = sched_defs[idef_index(b->insts[i]->def)].latency;
+        for (uint64_t k = i + 1; k < b->n; k++) {
+            if (b->dist[i][k] >= 0 && b->dist[i][k] + height[k] > height[i])
+                height[i] = b->dist[i][k] + height[k];
+        }
+    }
+
+    for (uint64_t j = 0; j < b->n; j++) {
+        earliest[j] = 0;
+        for (uint64_t r = 0; r < 16; r++) {
+            if ((b->effect[j].reads >> r) & 1 && b->reg_ready[r] > earliest[j])
+                earliest[j] = b->reg_ready[r];
+        }
+    }
+
+    uint64_t t = 0;
+
+    for (uint64_t p = 0; p < b->n; p++) {
+        int64_t best = -1;
+        uint64_t best_at = 0;
+
+        for (uint64_t j = 0; j < b->n; j++) {
+            if (done[j])
+                continue;
+
+            int ready = 1;
+            for (uint64_t i = 0; i < b->n && ready; i++) {
+                if (b->dist[i][j] >= 0 && !done[i])
+                    ready = 0;
+            }
+
+            if (!ready)
+                continue;
+
+            sched_def *d = &sched_defs[idef_index(b->insts[j]->def)];
+            uint64_t at = earliest[j] > t ? earliest[j] : t;
+
+            if (d->unit >= 0 && unit_free[d->unit] > at)
+                at = unit_free[d->unit];
+
+            //issuable now first, then by height; otherwise soonest
+            int better;
+            if (best < 0)
+                better = 1;
+            else if ((at <= t) != (best_at <= t))
+                better = at <= t;
+            else if (at <= t)
+                better = height[j] > height[best];
+            else
+                better = at < best_at || (at == best_at && height[j] > height[best]);
+
+            if (better) {
+                best = j;
+                best_at = at;
+            }
+        }
+
+        sched_def *d = &sched_defs[idef_index(b->insts[best]->def)];
+
+        order[p] = best;
+        done[best] = 1;
+        t = best_at + 1;
+
+        if (d->unit >= 0)
+            unit_free[d->unit] = best_at + d->busy;
+
+        for (uint64_t k = 0; k < b->n; k++) {
+            if (b->dist[best][k] >= 0 && best_at + b->dist[best][k] > earliest[k])
+                earliest[k] = best_at + b->dist[best][k];
+        }
+    }
+}
+
+void sched_block_run(sched_block *b, inst ***out, uint64_t *n_out) {
+    uint64_t original[SCHED_WINDOW];
+    uint64_t order[SCHED_WINDOW];
+    uint64_t stalls_original, stalls_order;
+
+    for (uint64_t j = 0; j < b->n; j++) {
+        original[j] = j;
+        b->effect[j] = sched_effect_of(b->insts[j]);
+    }
+
+    sched_dependences(b);
+
+    uint64_t t_original = sched_issue(b, original, NULL, NULL, &stalls_original);
+    uint64_t *chosen = original;
+
+    //a block without stalls is as good as it gets
+    if (stalls_original) {
+        sched_list(b, order);
+
+        if (sched_issue(b, order, NULL, NULL, &stalls_order) < t_original)
+            chosen = order;
+    }
+
+    sched_stalls_before += stalls_original;
+
+    if (chosen == order) {
+        for (uint64_t j = 0; j < b->n; j++)
+            sched_moved += order[j] != j;
+    }
+
+    uint64_t stalls;
+    uint64_t before = *n_out;
+    sched_issue(b, chosen, out, n_out, &stalls);
+
+    sched_fillers += *n_out - before - b->n;
+    if (!sched_filler)
+        sched_stalls_after += stalls;
+}
+
+void schedule_section(section *s) {
+    //every label address starts a block
+    uint8_t *leader = calloc(s->n_insts + 1, 1);
+    uint64_t k = 0;
+
+    for (uint64_t j = 0; j < s->n_labels; j++) {
+        for (label *l = s->label_table[j]; l; l = l->child) {
+            while (k < s->n_insts && s->inst_table[k]->address < l->address)
+                k++;
+            leader[k] = 1;
+        }
+    }
+
+    inst **table = NULL;
+    uint64_t *address = NULL;
+    uint64_t *slot_address = malloc(sizeof(*slot_address) * (s->n_insts + 1));
+    uint64_t n = 0;
+    int64_t shift = 0;
+
+    sched_block b;
+    memset(&b, 0, sizeof(b));
+
+    uint64_t first = 0;
+
+    while (first < s->n_insts) {
+        uint64_t end = first + 1;
+
+        while (end < s->n_insts && end - first < SCHED_WINDOW && !leader[end]
+               && s->inst_table[end]->address == s->inst_table[end - 1]->address + 1
+               && sched_defs[idef_index(s->inst_table[end - 1]->def)].flow == FLOW_NEXT)
+            end++;
+
+        //state carries over only by falling through into the next word
+        if (first > 0 && (s->inst_table[first]->address != s->inst_table[first - 1]->address + 1
+                          || sched_defs[idef_index(s->inst_table[first - 1]->def)].flow == FLOW_JUMP
+                          || sched_defs[idef_index(s->inst_table[first - 1]->def)].flow == FLOW_HALT)) {
+            memset(b.reg_ready, 0, sizeof(b.reg_ready));
+            memset(b.unit_free, 0, sizeof(b.unit_free));
+        }
+
+        b.insts = &s->inst_table[first];
+        b.n = end - first;
+
+        //no instruction waits longer than the longest latency or busy time
+        table = realloc(table, sizeof(*table) * (n + b.n * (sched_max_delay + 1) + 1));
+        address = realloc(address, sizeof(*address) * (n + b.n * (sched_max_delay + 1) + 1));
+
+        uint64_t start = n;
+        uint64_t old_start = s->inst_table[first]->address;
+        sched_block_run(&b, &table, &n);
+
+        //the block's first slot is its start, the others follow its instructions
+        uint64_t p = 0;
+        slot_address[first] = old_start + shift;
+        for (uint64_t q = start; q < n; q++) {
+            address[q] = old_start + shift + (q - start);
+
+            for (uint64_t j = 0; j < b.n; j++) {
+                if (table[q] == b.insts[j]) {
+                    if (p > 0)
+                        slot_address[first + p] = address[q];
+                    p++;
+                    break;
+                }
+            }
+        }
+
+        shift += (int64_t)(n - start) - (int64_t)b.n;
+        first = end;
+    }
+
+    slot_address[s->n_insts] = s->size + shift;
+
+    relayout_section(s, table, address, n, slot_address);
+
+    free(address);
+    free(slot_address);
+    free(leader);
+}
+
+void schedule_program() {
+    build_sched_defs();
+
+    if (!sched_filler) {
+        fprintf(stderr, "Warning: no filler instruction (tag one with filler, or define nop without operands), leaving stalls\n");
+        warn();
+    }
+
+    section **sections;
+    uint64_t n_sections = get_sections(&sections);
+
+    for (uint64_t s = 0; s < n_sections; s++) {
+        if (section_has_fixed_jumps(sections[s])) {
+            fprintf(stderr, "Warning: section %s jumps to numeric addresses, not scheduling it\n", sections[s]->ident);
+            warn();
+            continue;
+        }
+
+        schedule_section(sections[s]);
+    }
+
+    relayout_sections();
+
+    fprintf(stderr, "(schedule: %lu stall cycles -> %lu moved instructions, %lu fillers, %lu stall cycles)\n",
+            sched_stalls_before, sched_moved, sched_fillers, sched_stalls_after);
+
+    free(sched_defs);
+}
@@ -0,0 +1,406 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+#include "kasm.h"
+
+/*
+ * Instruction-set simulator for the assembled image. What an instruction
+ * does is given by a sim tag on its definition:
+ *
+ *   mov            oper1 = oper2
+ *   add, sub, and, or, xor, shl, shr
+ *                  oper1 = oper2 OP oper3
+ *   addi           oper1 = oper2 + imm
+ *   ldi            oper1 = imm
+ *   jmp            jump to imm
+ *   jz, jnz        jump to imm if oper1 is (not) zero
+ *   halt, nop
+ *
+ * Without a sim tag, the halt and jump tags stand for halt and jmp and
+ * anything else is a nop. A plain operand rB is register B, rB[x] is the
+ * memory word at rB + x and rB[x][y] the word at mem[rB + x] + y. Jump
+ * targets are label addresses, so they are relative to the section of
+ * the jumping instruction.
+ *
+ * Prefix words (the prefix tag) run as nops and supply the high bits of
+ * the next instruction's immediate, as laid out by --relax.
+ *
+ * The image is decoded once with the disassembler's table into an array
+ * holding the handler for every word, which the run loop dispatches
+ * through directly. It is either the one just assembled or, given a path,
+ * a bin or sparse image read back; that carries no sections, so the
+ * layout for jump targets and label counts comes from the source.
+ */
+
+char *sim_names[] = {
+    "nop", "mov", "add", "sub", "and", "or", "xor", "shl", "shr",
+    "addi", "ldi", "jmp", "jz", "jnz", "halt", NULL
+};
+
+//operands each kind uses
+uint64_t sim_operands[] = {
+    0, 2, 3, 3, 3, 3, 3, 3, 3,
+    2, 1, 0, 1, 1, 0
+};
+
+sim_kind sim_kind_of(idef *def, uint64_t n_operands) {
+    char *name = NULL;
+
+    if (!has_tag(def, "sim", NULL, &name) || !name) {
+        if (has_tag(def, "halt", NULL, NULL))
+            return SIM_HALT;
+        if (has_tag(def, "jump", NULL, NULL))
+            return SIM_JMP;
+        return SIM_NOP;
+    }
+
+    for (uint64_t k = 0; sim_names[k]; k++) {
+        if (strcmp(name, sim_names[k]) != 0)
+            continue;
+
+        if (n_operands < sim_operands[k]) {
+            fprintf(stderr, "Warning: sim=%s needs %lu operands, %s has %lu, treating as nop\n", name, sim_operands[k], def->ident, n_operands);
+            warn();
+            return SIM_NOP;
+        }
+
+        return k;
+    }
+
+    fprintf(stderr, "Warning: unknown sim=%s on %s, treating as nop\n", name, def->ident);
+    warn();
+
+    return SIM_NOP;
+}
+
+sim_operand sim_make_operand(operand *o) {
+    sim_operand s = { 0, 0, 0, 0 };
+
+    if (!o)
+        return s;
+
+    s.base = o->base;
+    if (o->offset1) {
+        s.depth = 1;
+        s.off1 = o->offset1 - 1;
+        if (o->offset2) {
+            s.depth = 2;
+            s.off2 = o->offset2 - 1;
+        }
+    }
+
+    return s;
+}
+
+//decodes the occupied words in [from, to), with jump targets relative to base
+void sim_decode_range(sim_inst *code, image *img, decode_table *t, sim_kind *kinds, uint8_t *prefix,
+                      uint64_t from, uint64_t to, uint64_t base) {
+    uint64_t high = 0;
+    int prefixed = 0;
+
+    for (uint64_t a = image_next(img, from); a < to && a < img->size; a = image_next(img, a + 1)) {
+        inst in;
+        operand ops[3];
+
+        if (decode_instruction(t, le32toh(img->words[a]), &in, ops)) {
+            prefixed = 0;
+            continue;
+        }
+
+        sim_inst *c = &code[a];
+
+        if (prefix[idef_index(in.def)]) {
+            c->kind = SIM_NOP;
+            high = prefixed ? (high << 14) | in.immediate : in.immediate;
+            prefixed = 1;
+            continue;
+        }
+
+        if (prefixed && in.type != NONE)
+            in.immediate |= high << (in.type == SINGLE ? 7 : 14);
+        prefixed = 0;
+
+        c->kind = kinds[idef_index(in.def)];
+        c->o[0] = sim_make_operand(in.oper1);
+        c->o[1] = sim_make_operand(in.oper2);
+        c->o[2] = sim_make_operand(in.oper3);
+        c->imm = in.immediate;
+
+        //jumps out of the image land on the fault entry
+        c->target = base + in.immediate;
+        if (c->target > img->size)
+            c->target = img->size;
+    }
+}
+
+/*
+ * One entry per image word plus a fault entry past the end. Sections give
+ * the bases of their jump targets; words outside every section, which
+ * only an image read from a file has, are taken to be absolute.
+ */
+sim_inst* sim_predecode(image *img, char *secname) {
+    decode_table *t = build_decode_table();
+    sim_inst *code = calloc(img->size + 1, sizeof(*code));
+
+    idef **table;
+    uint64_t n_idefs = get_definitions(&table);
+
+    sim_kind *kinds = malloc(sizeof(*kinds) * (n_idefs + 1));
+    uint8_t *prefix = malloc(n_idefs + 1);
+    for (uint64_t i = 0; i < n_idefs; i++) {
+        kinds[i] = sim_kind_of(table[i], idef_get_info(table[i])->n_operands);
+        prefix[i] = has_tag(table[i], "prefix", NULL, NULL);
+    }
+
+    for (uint64_t a = 0; a <= img->size; a++)
+        code[a].kind = SIM_FAULT;
+
+    section **sections;
+    uint64_t n_sections = get_sections(&sections);
+
+    section **sorted = malloc(sizeof(*sorted) * (n_sections + 1));
+    memcpy(sorted, sections, sizeof(*sorted) * n_sections);
+    qsort(sorted, n_sections, sizeof(*sorted), section_base_cmp);
+
+    uint64_t pos = 0;
+
+    for (uint64_t s = 0; s < n_sections; s++) {
+        section *sec = sorted[s];
+
+        if (sec->base > pos)
+            sim_decode_range(code, img, t, kinds, prefix, pos, sec->base, 0);
+        if (sec->base + sec->size > pos)
+            pos = sec->base + sec->size;
+
+        if (section_selected(sec, secname))
+            sim_decode_range(code, img, t, kinds, prefix, sec->base, sec->base + sec->size, sec->base);
+    }
+
+    sim_decode_range(code, img, t, kinds, prefix, pos, img->size, 0);
+
+    free(sorted);
+    free(kinds);
+    free(prefix);
+    free(t);
+
+    return code;
+}
+
+uint32_t* sim_ref(sim_state *st, sim_operand *o) {
+    if (!o->depth)
+        return &st->reg[o->base];
+
+    uint32_t a = st->reg[o->base] + o->off1;
+    if (o->depth == 2)
+        a = st->mem[a & (SIM_MEMORY_WORDS - 1)] + o->off2;
+
+    return &st->mem[a & (SIM_MEMORY_WORDS - 1)];
+}
+
+//runs from pc until a halt, a word without an instruction, or max_steps
+sim_kind sim_run(sim_state *st, uint64_t max_steps) {
+    static void *handlers[] = {
+        &&op_nop, &&op_mov, &&op_add, &&op_sub, &&op_and, &&op_or, &&op_xor, &&op_shl, &&op_shr,
+        &&op_addi, &&op_ldi, &&op_jmp, &&op_jz, &&op_jnz, &&op_halt, &&op_fault
+    };
+
+    sim_inst *code = st->code;
+
+    for (uint64_t a = 0; a <= st->size; a++)
+        code[a].handler = handlers[code[a].kind];
+
+    uint64_t pc = st->pc;
+    uint64_t steps = st->steps;
+    uint64_t *counts = st->counts;
+    sim_inst *i;
+    uint32_t v;
+    sim_kind stop;
+
+#define SIM_DISPATCH() do { \
+        if (steps == max_steps) { stop = SIM_NOP; goto done; } \
+        steps++; \
+        counts[pc]++; \
+        i = &code[pc]; \
+        goto *i->handler; \
+    } while (0)
+
+#define SIM_BINARY(OP) do { \
+        v = *sim_ref(st, &i->o[1]) OP *sim_ref(st, &i->o[2]); \
+        *sim_ref(st, &i->o[0]) = v; \
+        pc++; \
+        SIM_DISPATCH(); \
+    } while (0)
+
+    SIM_DISPATCH();
+
+op_nop:
+    pc++;
+    SIM_DISPATCH();
+op_mov:
+    v = *sim_ref(st, &i->o[1]);
+    *sim_ref(st, &i->o[0]) = v;
+    pc++;
+    SIM_DISPATCH();
+op_add:
+    SIM_BINARY(+);
+op_sub:
+    SIM_BINARY(-);
+op_and:
+    SIM_BINARY(&);
+op_or:
+    SIM_BINARY(|);
+op_xor:
+    SIM_BINARY(^);
+op_shl:
+    v = *sim_ref(st, &i->o[1]) << (*sim_ref(st, &i->o[2]) & 31);
+    *sim_ref(st, &i->o[0]) = v;
+    pc++;
+    SIM_DISPATCH();
+op_shr:
+    v = *sim_ref(st, &i->o[1]) >> (*sim_ref(st, &i->o[2]) & 31);
+    *sim_ref(st, &i->o[0]) = v;
+    pc++;
+    SIM_DISPATCH();
+op_addi:
+    v = *sim_ref(st, &i->o[1]) + i->imm;
+    *sim_ref(st, &i->o[0]) = v;
+    pc++;
+    SIM_DISPATCH();
+op_ldi:
+    *sim_ref(st, &i->o[0]) = i->imm;
+    pc++;
+    SIM_DISPATCH();
+op_jmp:
+    pc = i->target;
+    SIM_DISPATCH();
+op_jz:
+    pc = *sim_ref(st, &i->o[0]) ? pc + 1 : i->target;
+    SIM_DISPATCH();
+op_jnz:
+    pc = *sim_ref(st, &i->o[0]) ? i->target : pc + 1;
+    SIM_DISPATCH();
+op_halt:
+    stop = SIM_HALT;
+    goto done;
+op_fault:
+    //the fault word was counted as executed, but nothing ran
+    counts[pc]--;
+    steps--;
+    stop = SIM_FAULT;
+    goto done;
+
+#undef SIM_BINARY
+#undef SIM_DISPATCH
+
+done:
+    st->pc = pc;
+    st->steps = steps;
+
+    return stop;
+}
+
+uint64_t sim_count_range(sim_state *st, uint64_t from, uint64_t to) {
+    uint64_t n = 0;
+
+    for (uint64_t a = from; a < to && a < st->size; a++)
+        n += st->counts[a];
+
+    return n;
+}
+
+//each label counts the instructions from its address up to the next label
+void print_label_counts(sim_state *st, char *secname) {
+    section **sections;
+    uint64_t n_sections = get_sections(&sections);
+
+    for (uint64_t s = 0; s < n_sections; s++) {
+        section *sec = sections[s];
+
+        if (!section_selected(sec, secname))
+            continue;
+
+        //globals in order, each followed by its locals
+        uint64_t n = 0;
+        for (uint64_t j = 0; j < sec->n_labels; j++) {
+            for (label *l = sec->label_table[j]; l; l = l->child)
+                n++;
+        }
+
+        label **order = malloc(sizeof(*order) * (n + 1));
+        label **parent = malloc(sizeof(*parent) * (n + 1));
+        n = 0;
+        for (uint64_t j = 0; j < sec->n_labels; j++) {
+            for (label *l = sec->label_table[j]; l; l = l->child) {
+                parent[n] = sec->label_table[j];
+                order[n++] = l;
+            }
+        }
+
+        uint64_t first = n ? order[0]->address : sec->size;
+        uint64_t head = sim_count_range(st, sec->base, sec->base + first);
+
+        if (head)
+            printf("  %s: %lu\n", sec->ident, head);
+
+        for (uint64_t k = 0; k < n; k++) {
+            uint64_t end = (k + 1 < n) ? order[k + 1]->address : sec->size;
+            uint64_t count = sim_count_range(st, sec->base + order[k]->address, sec->base + end);
+
+            if (parent[k] == order[k])
+                printf("  %s: %s: %lu\n", sec->ident, order[k]->ident, count);
+            else
+                printf("  %s: %s.%s: %lu\n", sec->ident, parent[k]->ident, order[k]->ident, count);
+        }
+
+        free(order);
+        free(parent);
+    }
+}
+
+//runs the image at path, or without one the program just assembled
+int simulate(char *path, char *secname, uint64_t jobs, uint64_t max_steps) {
+    image *img = path ? image_read(path) : image_create(NULL, secname, 0);
+
+    if (!img)
+        return 1;
+
+    if (!path)
+        image_build(img, secname, jobs);
+
+    sim_state *st = calloc(1, sizeof(*st));
+    st->mem = calloc(SIM_MEMORY_WORDS, sizeof(*st->mem));
+    st->size = img->size;
+    st->counts = calloc(img->size + 1, sizeof(*st->counts));
+    st->code = sim_predecode(img, secname);
+    st->pc = image_next(img, 0);
+    if (st->pc > img->size)
+        st->pc = img->size;
+
+    sim_kind stop = sim_run(st, max_steps);
+
+    printf("simulation: %lu instructions, ", st->steps);
+    if (stop == SIM_HALT)
+        printf("halted at %lu\n", st->pc);
+    else if (stop == SIM_FAULT)
+        printf("no instruction at %lu\n", st->pc);
+    else
+        printf("step limit reached at %lu\n", st->pc);
+
+    for (uint64_t r = 0; r < 16; r++) {
+        if (st->reg[r])
+            printf("  r%lu = %u\n", r, st->reg[r]);
+    }
+
+    print_label_counts(st, secname);
+
+    free(st->mem);
+    free(st->counts);
+    free(st->code);
+    free(st);
+    image_free(img);
+
+    return stop == SIM_FAULT;
+}
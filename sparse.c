@@ -0,0 +1,288 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+#include "kasm.h"
+
+/*
+ * Sparse image format, all fields little-endian:
+ *
+ *   header:  "KSPR"  u32 version  u64 image size in words
+ *   record:  u32 kind  u32 count  u64 address  payload
+ *
+ *   SPARSE_RUN      payload is one u32; count copies of it start at address
+ *   SPARSE_LITERAL  payload is count u32 words, stored from address on
+ *   SPARSE_GAP      no payload; count unoccupied words start at address
+ *   SPARSE_END      count and address are 0, no payload
+ *
+ * Records are in address order and cover the image exactly once, so a
+ * loader can memset runs and memcpy literals straight into place. Gaps
+ * only need zeroing when the memory does not start out clear; sparse_load
+ * leaves them alone, which lets a delta be applied over an older image.
+ */
+
+#define SPARSE_VERSION (1)
+#define SPARSE_RECORD_BYTES (16)
+#define SPARSE_MAX_COUNT (0xFFFFFFFFLU)
+
+void sparse_u32(FILE *f, uint32_t v) {
+    v = htole32(v);
+    fwrite(&v, sizeof(v), 1, f);
+}
+
+void sparse_u64(FILE *f, uint64_t v) {
+    v = htole64(v);
+    fwrite(&v, sizeof(v), 1, f);
+}
+
+void sparse_record(FILE *f, sparse_kind kind, uint64_t count, uint64_t addr) {
+    sparse_u32(f, kind);
+    sparse_u32(f, count);
+    sparse_u64(f, addr);
+}
+
+//first unoccupied address at or after addr, or img->size
+uint64_t image_next_clear(image *img, uint64_t addr) {
+    if (addr >= img->size)
+        return img->size;
+
+    uint64_t w = addr >> 6;
+    uint64_t bits = ~img->valid[w] & (~0LU << (addr & 63));
+
+    while (!bits) {
+        if (++w > img->size >> 6)
+            return img->size;
+        bits = ~img->valid[w];
+    }
+
+    addr = (w << 6) + __builtin_ctzl(bits);
+
+    return (addr < img->size) ? addr : img->size;
+}
+
+void sparse_header(FILE *f, uint64_t size) {
+    fwrite("KSPR", 1, 4, f);
+    sparse_u32(f, SPARSE_VERSION);
+    sparse_u64(f, size);
+}
+
+//words are already little-endian, as in an image
+void sparse_literal(FILE *f, uint32_t *words, uint64_t from, uint64_t to) {
+    while (from < to) {
+        uint64_t n = to - from;
+
+        if (n > SPARSE_MAX_COUNT)
+            n = SPARSE_MAX_COUNT;
+
+        sparse_record(f, SPARSE_LITERAL, n, from);
+        fwrite(&words[from], sizeof(*words), n, f);
+
+        from += n;
+    }
+}
+
+/*
+ * Writes words [from, to) as runs and literals. A run costs a record and
+ * its word, and one inside a literal also splits it in two, adding a
+ * record; one covering the whole extent saves the literal's. It is taken
+ * when the words it replaces cost more.
+ */
+void sparse_extent(FILE *f, uint32_t *words, uint64_t from, uint64_t to) {
+    uint64_t lit = from;
+    uint64_t i = from;
+
+    while (i < to) {
+        uint64_t j = i + 1;
+
+        while (j < to && words[j] == words[i] && j - i < SPARSE_MAX_COUNT)
+            j++;
+
+        uint64_t cost = SPARSE_RECORD_BYTES + sizeof(*words);
+
+        if (lit < i && j < to)
+            cost += SPARSE_RECORD_BYTES;
+        else if (lit == i && j == to)
+            cost -= SPARSE_RECORD_BYTES;
+
+        if ((j - i) * sizeof(*words) > cost) {
+            sparse_literal(f, words, lit, i);
+            sparse_record(f, SPARSE_RUN, j - i, i);
+            fwrite(&words[i], sizeof(*words), 1, f);
+            lit = j;
+        }
+
+        i = j;
+    }
+
+    sparse_literal(f, words, lit, to);
+}
+
+void emit_sparse(FILE *f, image *img) {
+    sparse_header(f, img->size);
+
+    uint64_t addr = 0;
+
+    while (addr < img->size) {
+        uint64_t end = image_next(img, addr);
+
+        //gaps are split the same way as literals so every count fits in a u32
+        for (; addr < end; addr += SPARSE_MAX_COUNT) {
+            uint64_t n = end - addr;
+            sparse_record(f, SPARSE_GAP, n < SPARSE_MAX_COUNT ? n : SPARSE_MAX_COUNT, addr);
+        }
+
+        if (end >= img->size)
+            break;
+
+        addr = image_next_clear(img, end);
+        sparse_extent(f, img->words, end, addr);
+    }
+
+    sparse_record(f, SPARSE_END, 0, 0);
+}
+
+void sparse_mark(uint64_t *valid, uint64_t from, uint64_t to) {
+    if (!valid)
+        return;
+
+    for (uint64_t a = from; a < to; a++)
+        valid[a >> 6] |= 1LU << (a & 63);
+}
+
+/*
+ * Reads a sparse image into mem, which must hold at least as many words as
+ * the header announces (see sparse_size). Gaps are left untouched; the
+ * words covered by runs and literals are set in valid, if given. Returns
+ * their number, or -1 on a malformed file.
+ */
+int64_t sparse_load(FILE *f, uint32_t *mem, uint64_t *valid, uint64_t size) {
+    char magic[4];
+    uint32_t v32;
+    uint64_t v64;
+
+    if (fread(magic, 1, 4, f) != 4 || memcmp(magic, "KSPR", 4) != 0)
+        return -1;
+    if (fread(&v32, sizeof(v32), 1, f) != 1 || le32toh(v32) != SPARSE_VERSION)
+        return -1;
+    if (fread(&v64, sizeof(v64), 1, f) != 1 || le64toh(v64) > size)
+        return -1;
+
+    int64_t loaded = 0;
+
+    while (1) {
+        uint32_t kind, count;
+        uint64_t addr;
+
+        if (fread(&kind, sizeof(kind), 1, f) != 1 || fread(&count, sizeof(count), 1, f) != 1 || fread(&addr, sizeof(addr), 1, f) != 1)
+            return -1;
+
+        kind = le32toh(kind);
+        count = le32toh(count);
+        addr = le64toh(addr);
+
+        if (kind == SPARSE_END)
+            return loaded;
+
+        if (addr > size || count > size - addr)
+            return -1;
+
+        if (kind == SPARSE_RUN) {
+            uint32_t w;
+
+            if (fread(&w, sizeof(w), 1, f) != 1)
+                return -1;
+
+            w = le32toh(w);
+
+            if (w == 0) {
+                memset(&mem[addr], 0, count * sizeof(*mem));
+            } else {
+                for (uint64_t i = 0; i < count; i++)
+                    mem[addr + i] = w;
+            }
+        } else if (kind == SPARSE_LITERAL) {
+            if (fread(&mem[addr], sizeof(*mem), count, f) != count)
+                return -1;
+
+            for (uint64_t i = 0; i < count; i++)
+                mem[addr + i] = le32toh(mem[addr + i]);
+        } else if (kind == SPARSE_GAP) {
+            continue;
+        } else {
+            return -1;
+        }
+
+        sparse_mark(valid, addr, addr + count);
+        loaded += count;
+    }
+}
+
+//image size announced by a sparse file's header, or -1; leaves f positioned at the start
+int64_t sparse_size(FILE *f) {
+    char header[16];
+    uint64_t size;
+    int ok = fread(header, 1, 16, f) == 16 && memcmp(header, "KSPR", 4) == 0;
+
+    rewind(f);
+
+    if (!ok)
+        return -1;
+
+    memcpy(&size, &header[8], sizeof(size));
+
+    return le64toh(size);
+}
+
+/*
+ * Reads an image written with --format=bin or --format=sparse, telling
+ * them apart by the sparse header. A raw image has no gaps, so all of its
+ * words count as occupied. Words are kept little-endian, as in an image
+ * being built.
+ */
+image* image_read(char *path) {
+    FILE *f = fopen(path, "rb");
+
+    if (!f) {
+        perror(path);
+        return NULL;
+    }
+
+    image *img = calloc(1, sizeof(*img));
+    int64_t size = sparse_size(f);
+    int bad = 0;
+
+    img->fd = -1;
+
+    if (size >= 0) {
+        img->size = size;
+        img->words = calloc(img->size + 1, sizeof(*img->words));
+        img->valid = calloc((img->size + 63) / 64 + 1, sizeof(*img->valid));
+
+        bad = sparse_load(f, img->words, img->valid, img->size) < 0;
+
+        for (uint64_t a = 0; a < img->size; a++)
+            img->words[a] = htole32(img->words[a]);
+    } else {
+        fseek(f, 0, SEEK_END);
+        img->size = ftell(f) / sizeof(*img->words);
+        rewind(f);
+
+        img->words = calloc(img->size + 1, sizeof(*img->words));
+        img->valid = calloc((img->size + 63) / 64 + 1, sizeof(*img->valid));
+
+        bad = fread(img->words, sizeof(*img->words), img->size, f) != img->size;
+        sparse_mark(img->valid, 0, img->size);
+    }
+
+    fclose(f);
+
+    if (bad) {
+        fprintf(stderr, "%s: malformed image\n", path);
+        image_free(img);
+        return NULL;
+    }
+
+    return img;
+}
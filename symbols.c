@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "kasm.h"
+
+/*
+ * Binary symbol index, meant to be mapped and searched in place. All
+ * fields are little-endian:
+ *
+ *   header    "KSYM", version, section count, label count, string bytes
+ *   sections  {base, end, name, 0}, sorted by base
+ *   labels    {address, end, name, section}, sorted by address
+ *   strings   NUL-terminated names; locals are parent.local
+ *
+ * Addresses are real addresses. A label extends to the next label of its
+ * section or the end of the section, so of two labels at one address the
+ * first is empty and lookups find the second.
+ */
+
+#define SYMBOLS_MAGIC "KSYM"
+#define SYMBOLS_VERSION (1)
+
+typedef struct {
+    uint64_t address;
+    uint64_t end;
+    uint64_t section;
+    uint64_t seq;
+    char *name;
+} symbol_build;
+
+int symbol_build_cmp(const void *a, const void *b) {
+    const symbol_build *x = a;
+    const symbol_build *y = b;
+
+    if (x->address != y->address)
+        return (x->address > y->address) - (x->address < y->address);
+
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+void symbols_add(symbol_build **list, uint64_t *n, uint64_t address, uint64_t end, uint64_t sec, char *name) {
+    *list = realloc(*list, sizeof(**list) * (*n + 1));
+
+    (*list)[*n].address = address;
+    (*list)[*n].end = end;
+    (*list)[*n].section = sec;
+    (*list)[*n].seq = *n;
+    (*list)[*n].name = name;
+    (*n)++;
+}
+
+void symbols_write(FILE *f, symbol_build *list, uint64_t n, uint64_t *string_offset) {
+    for (uint64_t k = 0; k < n; k++) {
+        symbol_entry e;
+
+        e.address = htole64(list[k].address);
+        e.end = htole64(list[k].end);
+        e.name = htole32(*string_offset);
+        e.section = htole32(list[k].section);
+        fwrite(&e, sizeof(e), 1, f);
+
+        *string_offset += strlen(list[k].name) + 1;
+    }
+}
+
+void symbols_write_names(FILE *f, symbol_build *list, uint64_t n) {
+    for (uint64_t k = 0; k < n; k++) {
+        fwrite(list[k].name, 1, strlen(list[k].name) + 1, f);
+        free(list[k].name);
+    }
+}
+
+int emit_symbols(char *path, char *secname) {
+    section **sections;
+    uint64_t n_sections = get_sections(&sections);
+
+    symbol_build *secs = NULL;
+    symbol_build *labels = NULL;
+    uint64_t n_secs = 0, n_labels = 0;
+
+    for (uint64_t s = 0; s < n_sections; s++) {
+        section *sec = sections[s];
+        uint64_t end = sec->base + sec->size;
+
+        if (!section_selected(sec, secname))
+            continue;
+
+        uint64_t first = n_labels;
+
+        for (uint64_t j = 0; j < sec->n_labels; j++) {
+            label *g = sec->label_table[j];
+
+            symbols_add(&labels, &n_labels, sec->base + g->address, end, n_secs, strdup(g->ident));
+
+            for (label *l = g->child; l; l = l->child) {
+                char *name = malloc(strlen(g->ident) + strlen(l->ident) + 2);
+
+                sprintf(name, "%s.%s", g->ident, l->ident);
+                symbols_add(&labels, &n_labels, sec->base + l->address, end, n_secs, name);
+            }
+        }
+
+        for (uint64_t k = first; k + 1 < n_labels; k++)
+            labels[k].end = labels[k + 1].address;
+
+        symbols_add(&secs, &n_secs, sec->base, end, 0, strdup(sec->ident));
+    }
+
+    qsort(secs, n_secs, sizeof(*secs), symbol_build_cmp);
+    qsort(labels, n_labels, sizeof(*labels), symbol_build_cmp);
+
+    //labels refer to sections by sorted position
+    uint64_t *position = malloc(sizeof(*position) * (n_secs + 1));
+    for (uint64_t k = 0; k < n_secs; k++)
+        position[secs[k].seq] = k;
+    for (uint64_t k = 0; k < n_labels; k++)
+        labels[k].section = position[labels[k].section];
+    free(position);
+
+    FILE *f = fopen(path, "wb");
+
+    if (!f) {
+        perror(path);
+        return 1;
+    }
+
+    uint64_t strings = 0;
+    for (uint64_t k = 0; k < n_secs; k++)
+        strings += strlen(secs[k].name) + 1;
+    for (uint64_t k = 0; k < n_labels; k++)
+        strings += strlen(labels[k].name) + 1;
+
+    symbol_header h;
+    memcpy(h.magic, SYMBOLS_MAGIC, 4);
+    h.version = htole32(SYMBOLS_VERSION);
+    h.n_sections = htole64(n_secs);
+    h.n_labels = htole64(n_labels);
+    h.strings_size = htole64(strings);
+    fwrite(&h, sizeof(h), 1, f);
+
+    uint64_t offset = 0;
+    symbols_write(f, secs, n_secs, &offset);
+    symbols_write(f, labels, n_labels, &offset);
+    symbols_write_names(f, secs, n_secs);
+    symbols_write_names(f, labels, n_labels);
+
+    free(secs);
+    free(labels);
+
+    if (fclose(f)) {
+        perror(path);
+        return 1;
+    }
+
+    return 0;
+}
+
+symbol_index* symbol_open(char *path) {
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) || sb.st_size < (off_t)sizeof(symbol_header)) {
+        fprintf(stderr, "%s: not a symbol index\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        perror(path);
+        return NULL;
+    }
+
+    symbol_header *h = map;
+    uint64_t n_sections = le64toh(h->n_sections);
+    uint64_t n_labels = le64toh(h->n_labels);
+    uint64_t strings = le64toh(h->strings_size);
+
+    if (memcmp(h->magic, SYMBOLS_MAGIC, 4) || le32toh(h->version) != SYMBOLS_VERSION
+        || sizeof(*h) + (n_sections + n_labels) * sizeof(symbol_entry) + strings != (uint64_t)sb.st_size) {
+        fprintf(stderr, "%s: not a symbol index\n", path);
+        munmap(map, sb.st_size);
+        return NULL;
+    }
+
+    symbol_index *idx = malloc(sizeof(*idx));
+    idx->map = map;
+    idx->size = sb.st_size;
+    idx->sections = (symbol_entry*)(h + 1);
+    idx->n_sections = n_sections;
+    idx->labels = idx->sections + n_sections;
+    idx->n_labels = n_labels;
+    idx->strings = (char*)(idx->labels + n_labels);
+
+    return idx;
+}
+
+void symbol_close(symbol_index *idx) {
+    munmap(idx->map, idx->size);
+    free(idx);
+}
+
+//the last entry at or below address, if address falls within it
+symbol_entry* symbol_search(symbol_entry *table, uint64_t n, uint64_t address) {
+    uint64_t lo = 0;
+
+    //lo ends on the number of entries at or below address
+    while (n > 0) {
+        uint64_t half = n / 2;
+
+        if (le64toh(table[lo + half].address) <= address) {
+            lo += half + 1;
+            n -= half + 1;
+        } else {
+            n = half;
+        }
+    }
+
+    if (lo == 0 || address >= le64toh(table[lo - 1].end))
+        return NULL;
+
+    return &table[lo - 1];
+}
+
+symbol_entry* symbol_lookup(symbol_index *idx, uint64_t address) {
+    return symbol_search(idx->labels, idx->n_labels, address);
+}
+
+symbol_entry* symbol_section(symbol_index *idx, uint64_t address) {
+    return symbol_search(idx->sections, idx->n_sections, address);
+}
+
+char* symbol_name(symbol_index *idx, symbol_entry *e) {
+    return idx->strings + le32toh(e->name);
+}
+
+//one address per line on stdin, decimal or 0x hex
+int symbolize(char *path) {
+    symbol_index *idx = symbol_open(path);
+
+    if (!idx)
+        return 1;
+
+    char line[128];
+
+    while (fgets(line, sizeof(line), stdin)) {
+        char *end;
+        uint64_t address = strtoull(line, &end, 0);
+
+        if (end == line)
+            continue;
+
+        symbol_entry *l = symbol_lookup(idx, address);
+        symbol_entry *s = symbol_section(idx, address);
+
+        if (l)
+            printf("%lu %s:%s+%lu\n", address, symbol_name(idx, &idx->sections[le32toh(l->section)]),
+                   symbol_name(idx, l), address - le64toh(l->address));
+        else if (s)
+            printf("%lu %s+%lu\n", address, symbol_name(idx, s), address - le64toh(s->address));
+        else
+            printf("%lu ?\n", address);
+    }
+
+    symbol_close(idx);
+
+    return 0;
+}
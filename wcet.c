@@ -0,0 +1,677 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "kasm.h"
+
+/*
+ * Static timing analysis. Every instruction costs its cycles tag (1 when
+ * there is none). Control flow follows the simulator's view of the
+ * definitions: jmp and the jump tag go to the immediate, jz, jnz and the
+ * branch tag may also fall through, halt ends the path. Jumps stay within
+ * their section, and the end of a section ends the path.
+ *
+ * Basic blocks start at labels, jump targets and after control flow. For
+ * the worst case, every strongly connected region is one loop, entered
+ * through its header block. Its cost is the loop bound given for the
+ * header label times the worst single pass from the header back to it, a
+ * pass being analysed the same way so nested loops need bounds of their
+ * own. The longest path through the resulting acyclic graph is the worst
+ * case, measured up to, but not including, the target block.
+ */
+
+#define WCET_UNBOUNDED (UINT64_MAX)
+
+wcet_block *wcet_blocks = NULL;
+uint64_t n_wcet_blocks = 0;
+
+//scratch for the loop search, valid for a block when its stamp matches
+int64_t *wcet_region = NULL;
+int64_t *wcet_visited = NULL;
+uint64_t *wcet_index = NULL;
+uint64_t *wcet_low = NULL;
+uint64_t *wcet_comp = NULL;
+int64_t wcet_stamp = 0;
+
+char *wcet_unbounded_at = NULL;
+
+//per definition, so tag warnings come once
+wcet_flow *wcet_def_flow = NULL;
+uint64_t *wcet_def_cycles = NULL;
+
+uint64_t wcet_add(uint64_t a, uint64_t b) {
+    return (a > WCET_UNBOUNDED - b) ? WCET_UNBOUNDED : a + b;
+}
+
+uint64_t wcet_mul(uint64_t a, uint64_t b) {
+    return (a && b > WCET_UNBOUNDED / a) ? WCET_UNBOUNDED : a * b;
+}
+
+uint64_t inst_cycles(idef *def) {
+    uint64_t v = 0;
+    char *s = NULL;
+
+    if (!has_tag(def, "cycles", &v, &s))
+        return 1;
+
+    //numeric tag values are stored plus one
+    if (v == 0) {
+        fprintf(stderr, "Warning: tag cycles on %s without numeric value, assuming 1\n", def->ident);
+        warn();
+        return 1;
+    }
+
+    return v - 1;
+}
+
+wcet_flow inst_flow(idef *def) {
+    switch (sim_kind_of(def, idef_get_info(def)->n_operands)) {
+        case SIM_JMP:
+            return FLOW_JUMP;
+        case SIM_JZ:
+        case SIM_JNZ:
+            return FLOW_BRANCH;
+        case SIM_HALT:
+            return FLOW_HALT;
+        default:
+            return has_tag(def, "branch", NULL, NULL) ? FLOW_BRANCH : FLOW_NEXT;
+    }
+}
+
+//numeric jump targets would not follow code that a pass moves
+int section_has_fixed_jumps(section *s) {
+    for (uint64_t k = 0; k < s->n_insts; k++) {
+        inst *in = s->inst_table[k];
+
+        if (in->type == GLOBAL_LABEL || in->type == LOCAL_LABEL)
+            continue;
+
+        wcet_flow flow = inst_flow(in->def);
+
+        if (flow == FLOW_JUMP || flow == FLOW_BRANCH)
+            return 1;
+    }
+
+    return 0;
+}
+
+//index of the instruction at a section-relative address, or -1
+int64_t wcet_find_inst(section *s, uint64_t address) {
+    uint64_t lo = 0, hi = s->n_insts;
+
+    while (lo < hi) {
+        uint64_t mid = (lo + hi) / 2;
+
+        if (s->inst_table[mid]->address < address)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return (lo < s->n_insts && s->inst_table[lo]->address == address) ? (int64_t)lo : -1;
+}
+
+void wcet_add_block(section *s, uint64_t first, uint64_t end) {
+    wcet_blocks = realloc(wcet_blocks, sizeof(*wcet_blocks) * (n_wcet_blocks + 1));
+
+    wcet_block *b = &wcet_blocks[n_wcet_blocks++];
+    b->sec = s;
+    b->first = first;
+    b->end = end;
+    b->address = s->base + s->inst_table[first]->address;
+    b->cycles = 0;
+    b->n_succ = 0;
+    b->bound = 0;
+    b->name = NULL;
+
+    for (uint64_t k = first; k < end; k++)
+        b->cycles = wcet_add(b->cycles, wcet_def_cycles[idef_index(s->inst_table[k]->def)]);
+}
+
+//the last label at or before the block, as in the symbol index
+void wcet_name_block(wcet_block *b, label *l, label *parent) {
+    uint64_t address = b->sec->inst_table[b->first]->address;
+    char buf[512];
+
+    if (!l)
+        snprintf(buf, sizeof(buf), "%s+%lu", b->sec->ident, address);
+    else if (l == parent)
+        snprintf(buf, sizeof(buf), "%s+%lu", l->ident, address - l->address);
+    else
+        snprintf(buf, sizeof(buf), "%s.%s+%lu", parent->ident, l->ident, address - l->address);
+
+    //drop a zero offset
+    char *plus = strrchr(buf, '+');
+    if (strcmp(plus, "+0") == 0)
+        *plus = '\0';
+
+    b->name = strdup(buf);
+}
+
+void build_wcet_blocks(char *secname) {
+    section **sections;
+    uint64_t n_sections = get_sections(&sections);
+
+    idef **table;
+    uint64_t n_idefs = get_definitions(&table);
+
+    wcet_def_flow = malloc(sizeof(*wcet_def_flow) * (n_idefs + 1));
+    wcet_def_cycles = malloc(sizeof(*wcet_def_cycles) * (n_idefs + 1));
+
+    for (uint64_t i = 0; i < n_idefs; i++) {
+        wcet_def_flow[i] = inst_flow(table[i]);
+        wcet_def_cycles[i] = inst_cycles(table[i]);
+    }
+
+    for (uint64_t s = 0; s < n_sections; s++) {
+        section *sec = sections[s];
+
+        if (!section_selected(sec, secname) || sec->n_insts == 0)
+            continue;
+
+        uint8_t *leader = calloc(sec->n_insts + 1, 1);
+        leader[0] = 1;
+
+        for (uint64_t j = 0; j < sec->n_labels; j++) {
+            for (label *l = sec->label_table[j]; l; l = l->child) {
+                int64_t k = wcet_find_inst(sec, l->address);
+                if (k >= 0)
+                    leader[k] = 1;
+            }
+        }
+
+        for (uint64_t k = 0; k < sec->n_insts; k++) {
+            inst *in = sec->inst_table[k];
+            wcet_flow flow = wcet_def_flow[idef_index(in->def)];
+
+            if (flow == FLOW_NEXT)
+                continue;
+
+            leader[k + 1] = 1;
+
+            if (flow != FLOW_HALT) {
+                int64_t t = wcet_find_inst(sec, in->immediate);
+                if (t >= 0)
+                    leader[t] = 1;
+            }
+        }
+
+        //globals in order, each followed by its locals
+        uint64_t n_labels = 0;
+        for (uint64_t j = 0; j < sec->n_labels; j++) {
+            for (label *l = sec->label_table[j]; l; l = l->child)
+                n_labels++;
+        }
+
+        label **labels = malloc(sizeof(*labels) * (n_labels + 1));
+        label **parents = malloc(sizeof(*parents) * (n_labels + 1));
+        n_labels = 0;
+        for (uint64_t j = 0; j < sec->n_labels; j++) {
+            for (label *l = sec->label_table[j]; l; l = l->child) {
+                parents[n_labels] = sec->label_table[j];
+                labels[n_labels++] = l;
+            }
+        }
+
+        uint64_t first_block = n_wcet_blocks;
+        uint64_t start = 0;
+
+        for (uint64_t k = 1; k <= sec->n_insts; k++) {
+            if (leader[k] || k == sec->n_insts) {
+                wcet_add_block(sec, start, k);
+                start = k;
+            }
+        }
+
+        //block of every leader instruction, for the edges
+        uint64_t *block_of = malloc(sizeof(*block_of) * (sec->n_insts + 1));
+        for (uint64_t b = first_block; b < n_wcet_blocks; b++)
+            block_of[wcet_blocks[b].first] = b;
+
+        uint64_t cursor = 0;
+
+        for (uint64_t b = first_block; b < n_wcet_blocks; b++) {
+            wcet_block *blk = &wcet_blocks[b];
+            inst *last = sec->inst_table[blk->end - 1];
+            wcet_flow flow = wcet_def_flow[idef_index(last->def)];
+
+            if (flow == FLOW_JUMP || flow == FLOW_BRANCH) {
+                int64_t t = wcet_find_inst(sec, last->immediate);
+
+                if (t >= 0) {
+                    blk->succ[blk->n_succ++] = block_of[t];
+                } else {
+                    fprintf(stderr, "Warning: jump at %lu in section %s to %lu has no instruction, ending path there\n",
+                            sec->base + last->address, sec->ident, sec->base + last->immediate);
+                    warn();
+                }
+            }
+
+            if ((flow == FLOW_NEXT || flow == FLOW_BRANCH) && b + 1 < n_wcet_blocks)
+                blk->succ[blk->n_succ++] = b + 1;
+
+            while (cursor < n_labels && labels[cursor]->address <= sec->inst_table[blk->first]->address)
+                cursor++;
+
+            wcet_name_block(blk, cursor ? labels[cursor - 1] : NULL, cursor ? parents[cursor - 1] : NULL);
+        }
+
+        free(labels);
+        free(parents);
+        free(block_of);
+        free(leader);
+    }
+
+    wcet_region = calloc(n_wcet_blocks + 1, sizeof(*wcet_region));
+    wcet_visited = calloc(n_wcet_blocks + 1, sizeof(*wcet_visited));
+    wcet_index = calloc(n_wcet_blocks + 1, sizeof(*wcet_index));
+    wcet_low = calloc(n_wcet_blocks + 1, sizeof(*wcet_low));
+    wcet_comp = calloc(n_wcet_blocks + 1, sizeof(*wcet_comp));
+}
+
+//label or parent.local, in any selected section; the block starting there
+int64_t wcet_lookup_block(char *name) {
+    for (uint64_t b = 0; b < n_wcet_blocks; b++) {
+        section *sec = wcet_blocks[b].sec;
+        uint64_t address = sec->inst_table[wcet_blocks[b].first]->address;
+
+        //labels are searched once per section, from its first block
+        if (b > 0 && wcet_blocks[b - 1].sec == sec)
+            continue;
+
+        for (uint64_t j = 0; j < sec->n_labels; j++) {
+            label *g = sec->label_table[j];
+            size_t n = strlen(g->ident);
+
+            if (strncmp(name, g->ident, n) != 0 || (name[n] != '\0' && name[n] != '.'))
+                continue;
+
+            label *l = g;
+            if (name[n] == '.')
+                for (l = g->child; l && strcmp(l->ident, name + n + 1) != 0; l = l->child)
+                    ;
+
+            if (!l)
+                continue;
+
+            for (uint64_t k = b; k < n_wcet_blocks && wcet_blocks[k].sec == sec; k++) {
+                address = sec->inst_table[wcet_blocks[k].first]->address;
+
+                if (address == l->address)
+                    return k;
+            }
+        }
+    }
+
+    return -1;
+}
+
+int set_loop_bound(char *arg) {
+    char *eq = strrchr(arg, '=');
+
+    if (!eq || eq == arg || !eq[1])
+        return 1;
+
+    *eq = '\0';
+    int64_t b = wcet_lookup_block(arg);
+    uint64_t bound = strtoull(eq + 1, NULL, 0);
+    *eq = '=';
+
+    if (b < 0) {
+        fprintf(stderr, "Warning: --loop-bound: no label %.*s, ignoring\n", (int)(eq - arg), arg);
+        warn();
+        return 0;
+    }
+
+    wcet_blocks[b].bound = bound;
+
+    return 0;
+}
+
+int wcet_follows(int64_t region, uint64_t entry, int ignore_entry, uint64_t w) {
+    return wcet_region[w] == region && !(ignore_entry && w == entry);
+}
+
+/*
+ * Longest path from entry over the blocks of a region, to target or, with
+ * target -1, to wherever the path ends. With ignore_entry, edges back to
+ * the entry are left out, which gives one pass of the loop it heads.
+ */
+uint64_t wcet_longest(int64_t region, uint64_t entry, int ignore_entry, int64_t target, int report) {
+    int64_t stamp = ++wcet_stamp;
+
+    //iterative Tarjan from entry; components come out sinks first
+    uint64_t *stack = malloc(sizeof(*stack) * (n_wcet_blocks + 1));
+    uint64_t *frame = malloc(sizeof(*frame) * (n_wcet_blocks + 1));
+    uint64_t *next_succ = malloc(sizeof(*next_succ) * (n_wcet_blocks + 1));
+    uint64_t *members = malloc(sizeof(*members) * (n_wcet_blocks + 1));
+    uint64_t *comp_start = malloc(sizeof(*comp_start) * (n_wcet_blocks + 2));
+    uint8_t *on_stack = calloc(n_wcet_blocks + 1, 1);
+    uint64_t n_stack = 0, n_frames = 0, n_members = 0, n_comps = 0, counter = 0;
+
+    wcet_visited[entry] = stamp;
+    wcet_index[entry] = wcet_low[entry] = counter++;
+    stack[n_stack++] = entry;
+    on_stack[entry] = 1;
+    frame[n_frames] = entry;
+    next_succ[n_frames++] = 0;
+
+    while (n_frames) {
+        uint64_t v = frame[n_frames - 1];
+
+        if (next_succ[n_frames - 1] < wcet_blocks[v].n_succ) {
+            uint64_t w = wcet_blocks[v].succ[next_succ[n_frames - 1]++];
+
+            if (!wcet_follows(region, entry, ignore_entry, w))
+                continue;
+
+            if (wcet_visited[w] != stamp) {
+                wcet_visited[w] = stamp;
+                wcet_index[w] = wcet_low[w] = counter++;
+                stack[n_stack++] = w;
+                on_stack[w] = 1;
+                frame[n_frames] = w;
+                next_succ[n_frames++] = 0;
+            } else if (on_stack[w] && wcet_index[w] < wcet_low[v]) {
+                wcet_low[v] = wcet_index[w];
+            }
+
+            continue;
+        }
+
+        n_frames--;
+
+        if (n_frames && wcet_low[v] < wcet_low[frame[n_frames - 1]])
+            wcet_low[frame[n_frames - 1]] = wcet_low[v];
+
+        if (wcet_low[v] == wcet_index[v]) {
+            comp_start[n_comps] = n_members;
+
+            uint64_t w;
+            do {
+                w = stack[--n_stack];
+                on_stack[w] = 0;
+                wcet_comp[w] = n_comps;
+                members[n_members++] = w;
+            } while (w != v);
+
+            n_comps++;
+        }
+    }
+
+    comp_start[n_comps] = n_members;
+
+    free(stack);
+    free(frame);
+    free(next_succ);
+    free(on_stack);
+
+    //edges between components and loop headers, before recursion reuses the scratch
+    uint64_t *edge_to = malloc(sizeof(*edge_to) * (2 * n_members + 1));
+    uint64_t *edge_start = malloc(sizeof(*edge_start) * (n_comps + 1));
+    int64_t *header = malloc(sizeof(*header) * (n_comps + 1));
+    uint8_t *cyclic = calloc(n_comps + 1, 1);
+    uint64_t n_edges = 0;
+    int64_t target_comp = (target >= 0 && wcet_visited[target] == stamp) ? (int64_t)wcet_comp[target] : -1;
+
+    for (uint64_t c = 0; c < n_comps; c++)
+        header[c] = -1;
+    header[wcet_comp[entry]] = entry;
+
+    for (uint64_t c = 0; c < n_comps; c++) {
+        edge_start[c] = n_edges;
+
+        for (uint64_t m = comp_start[c]; m < comp_start[c + 1]; m++) {
+            wcet_block *b = &wcet_blocks[members[m]];
+
+            for (uint64_t k = 0; k < b->n_succ; k++) {
+                uint64_t w = b->succ[k];
+
+                if (!wcet_follows(region, entry, ignore_entry, w))
+                    continue;
+
+                if (wcet_comp[w] == c) {
+                    cyclic[c] = 1;
+                    continue;
+                }
+
+                edge_to[n_edges++] = wcet_comp[w];
+
+                if (header[wcet_comp[w]] < 0) {
+                    header[wcet_comp[w]] = w;
+                } else if (header[wcet_comp[w]] != (int64_t)w) {
+                    fprintf(stderr, "Warning: loop at %s is also entered at %s, timing it from %s only\n",
+                            wcet_blocks[header[wcet_comp[w]]].name, wcet_blocks[w].name, wcet_blocks[header[wcet_comp[w]]].name);
+                    warn();
+                }
+            }
+        }
+    }
+
+    edge_start[n_comps] = n_edges;
+
+    uint64_t start = wcet_comp[entry];
+
+    //a target inside a loop, the one at entry included, is timed within it
+    uint64_t into = 0;
+    int partial = target_comp >= 0 && cyclic[target_comp] && header[target_comp] != target;
+
+    if (partial)
+        into = wcet_into_loop(&members[comp_start[target_comp]], comp_start[target_comp + 1] - comp_start[target_comp],
+                              header[target_comp], target);
+
+    uint64_t *cost = malloc(sizeof(*cost) * (n_comps + 1));
+
+    for (uint64_t c = 0; c < n_comps; c++) {
+        if (!cyclic[c]) {
+            cost[c] = wcet_blocks[members[comp_start[c]]].cycles;
+            continue;
+        }
+
+        wcet_block *h = &wcet_blocks[header[c]];
+
+        if (!h->bound) {
+            if (!wcet_unbounded_at)
+                wcet_unbounded_at = h->name;
+            cost[c] = WCET_UNBOUNDED;
+            continue;
+        }
+
+        int64_t inner = ++wcet_stamp;
+        for (uint64_t m = comp_start[c]; m < comp_start[c + 1]; m++)
+            wcet_region[members[m]] = inner;
+
+        cost[c] = wcet_mul(h->bound, wcet_longest(inner, header[c], 1, -1, 0));
+    }
+
+    //sinks come first, so successors are done before their predecessors
+    uint64_t *dist = malloc(sizeof(*dist) * (n_comps + 1));
+    int64_t *best = malloc(sizeof(*best) * (n_comps + 1));
+    uint8_t *reaches = calloc(n_comps + 1, 1);
+
+    for (uint64_t c = 0; c < n_comps; c++) {
+        best[c] = -1;
+        dist[c] = 0;
+
+        if ((int64_t)c == target_comp) {
+            reaches[c] = 1;
+            dist[c] = into;
+            continue;
+        }
+
+        for (uint64_t e = edge_start[c]; e < edge_start[c + 1]; e++) {
+            uint64_t d = edge_to[e];
+
+            if (target >= 0 && !reaches[d])
+                continue;
+
+            if (best[c] < 0 || dist[d] > dist[best[c]])
+                best[c] = d;
+        }
+
+        if (target >= 0 && best[c] < 0)
+            continue;
+
+        reaches[c] = 1;
+        dist[c] = wcet_add(cost[c], best[c] < 0 ? 0 : dist[best[c]]);
+    }
+
+    uint64_t result = reaches[start] ? dist[start] : WCET_UNBOUNDED;
+
+    if (report && reaches[start]) {
+        for (int64_t c = start; c >= 0 && c != target_comp; c = best[c]) {
+            wcet_block *h = &wcet_blocks[header[c]];
+
+            if (cyclic[c] && cost[c] == WCET_UNBOUNDED)
+                printf("  loop %s: unbounded\n", h->name);
+            else if (cyclic[c])
+                printf("  loop %s x %lu: %lu cycles\n", h->name, h->bound, cost[c]);
+            else
+                printf("  %s: %lu cycles\n", h->name, cost[c]);
+        }
+
+        if (partial && into == WCET_UNBOUNDED)
+            printf("  loop %s up to %s: unbounded\n", wcet_blocks[header[target_comp]].name, wcet_blocks[target].name);
+        else if (partial)
+            printf("  loop %s up to %s: %lu cycles\n", wcet_blocks[header[target_comp]].name, wcet_blocks[target].name, into);
+    }
+
+    if (target >= 0 && !reaches[start])
+        result = WCET_UNBOUNDED - 1;
+
+    free(members);
+    free(comp_start);
+    free(edge_to);
+    free(edge_start);
+    free(header);
+    free(cyclic);
+    free(cost);
+    free(dist);
+    free(best);
+    free(reaches);
+
+    return result;
+}
+
+/*
+ * From a loop's header to target inside it: passes that miss target, if
+ * control can get back to the header around it, then one that reaches it.
+ */
+uint64_t wcet_into_loop(uint64_t *members, uint64_t n, uint64_t header, uint64_t target) {
+    wcet_block *h = &wcet_blocks[header];
+    int64_t inner = ++wcet_stamp;
+
+    for (uint64_t m = 0; m < n; m++)
+        wcet_region[members[m]] = inner;
+
+    uint64_t *work = malloc(sizeof(*work) * (n + 1));
+    uint8_t *seen = calloc(n_wcet_blocks + 1, 1);
+    uint64_t n_work = 0;
+    int again = 0;
+
+    seen[header] = 1;
+    work[n_work++] = header;
+    while (n_work) {
+        wcet_block *b = &wcet_blocks[work[--n_work]];
+
+        for (uint64_t k = 0; k < b->n_succ; k++) {
+            uint64_t w = b->succ[k];
+
+            if (w == header)
+                again = 1;
+            else if (wcet_region[w] == inner && w != target && !seen[w]) {
+                seen[w] = 1;
+                work[n_work++] = w;
+            }
+        }
+    }
+
+    free(work);
+    free(seen);
+
+    uint64_t reach = wcet_longest(inner, header, 1, target, 0);
+
+    if (reach >= WCET_UNBOUNDED - 1)
+        return WCET_UNBOUNDED;
+
+    if (!again)
+        return reach;
+
+    if (!h->bound) {
+        if (!wcet_unbounded_at)
+            wcet_unbounded_at = h->name;
+        return WCET_UNBOUNDED;
+    }
+
+    //the recursion restamps inner loops
+    inner = ++wcet_stamp;
+    for (uint64_t m = 0; m < n; m++)
+        wcet_region[members[m]] = inner;
+
+    return wcet_add(wcet_mul(h->bound - 1, wcet_longest(inner, header, 1, -1, 0)), reach);
+}
+
+void print_wcet_blocks() {
+    section *sec = NULL;
+
+    for (uint64_t b = 0; b < n_wcet_blocks; b++) {
+        wcet_block *blk = &wcet_blocks[b];
+
+        if (blk->sec != sec) {
+            sec = blk->sec;
+            printf("cycles: section %s\n", sec->ident);
+        }
+
+        printf("  %s: %lu instructions, %lu cycles @ %lu\n", blk->name, blk->end - blk->first, blk->cycles, blk->address);
+    }
+}
+
+//FROM or FROM,TO
+int analyse_wcet(char *path, char *secname, char **loop_bounds, uint64_t n_loop_bounds) {
+    build_wcet_blocks(secname);
+
+    for (uint64_t k = 0; k < n_loop_bounds; k++) {
+        if (set_loop_bound(loop_bounds[k])) {
+            fprintf(stderr, "Warning: --loop-bound: expected LABEL=N, ignoring %s\n", loop_bounds[k]);
+            warn();
+        }
+    }
+
+    print_wcet_blocks();
+
+    if (!path)
+        return 0;
+
+    char *from = strdup(path);
+    char *to = strchr(from, ',');
+
+    if (to)
+        *to++ = '\0';
+
+    int64_t f = wcet_lookup_block(from);
+    int64_t t = to ? wcet_lookup_block(to) : -1;
+
+    if (f < 0 || (to && t < 0)) {
+        fprintf(stderr, "wcet: no label %s\n", f < 0 ? from : to);
+        free(from);
+        return 1;
+    }
+
+    printf("worst case %s to %s:\n", from, to ? to : "end");
+
+    uint64_t w = wcet_longest(0, f, 0, t, 1);
+
+    if (w == WCET_UNBOUNDED - 1)
+        printf("  %s is not reachable\n", to);
+    else if (w == WCET_UNBOUNDED && wcet_unbounded_at)
+        printf("  unbounded: no --loop-bound for the loop at %s\n", wcet_unbounded_at);
+    else if (w == WCET_UNBOUNDED)
+        printf("  unbounded\n");
+    else
+        printf("  total: %lu cycles\n", w);
+
+    free(from);
+
+    return 0;
+}